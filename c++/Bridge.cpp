@@ -0,0 +1,605 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "Bridge.h"
+
+namespace utils {
+
+static const size_t kReadBuffer = 64 * 1024;
+/*! longest wait for room before checking Close again */
+static const auto kDeliverSlice = std::chrono::milliseconds(50);
+
+namespace {
+
+/*! Event rebuilt from a frame by the default factory */
+class BridgedEvent : public Event
+{
+  public:
+    BridgedEvent(uint32_t id, EvtPriority pri, EventBuffer payload) : id_(id), pri_(pri)
+    {
+        Attach(std::move(payload));
+    }
+    virtual uint32_t ID() const { return id_; }
+    virtual const char* Name() const { return "bridged"; }
+    virtual EvtPriority Priority() const { return pri_; }
+
+  private:
+    uint32_t id_;
+    EvtPriority pri_;
+};
+
+void EncodeHeader(uint8_t *h, uint32_t id, EvtPriority pri, size_t len)
+{
+    uint32_t v = htonl(static_cast<uint32_t>(len));
+    memcpy(h, &v, 4);
+    v = htonl(id);
+    memcpy(h + 4, &v, 4);
+    h[8] = ToEvthubPriority(pri);
+    h[9] = h[10] = h[11] = 0;
+}
+
+void DecodeHeader(const uint8_t *h, uint32_t &id, EvtPriority &pri, uint32_t &len)
+{
+    uint32_t v;
+    memcpy(&v, h, 4);
+    len = ntohl(v);
+    memcpy(&v, h + 4, 4);
+    id = ntohl(v);
+    pri = FromEvthubPriority(h[8]); // every byte is a valid priority
+}
+
+int UnixSocket(const std::string &path, sockaddr_un &addr)
+{
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+bool TcpAddress(const std::string &host, uint16_t port, sockaddr_in &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    return inet_pton(AF_INET, host.c_str(), &addr.sin_addr) == 1;
+}
+
+}
+
+BridgeSender::BridgeSender(size_t queue, size_t batch)
+  : max_(queue ? queue : 1)
+  , batch_(std::min<size_t>(batch ? batch : 1, IOV_MAX / 2))
+  , fd_(-1)
+  , ranges_()
+  , mutex_()
+  , readable_()
+  , writable_()
+  , queue_()
+  , closing_(false)
+  , broken_(false)
+  , stats_()
+  , writer_()
+{
+}
+
+BridgeSender::~BridgeSender()
+{
+    Close();
+}
+
+bool BridgeSender::ConnectUnix(const std::string &path)
+{
+    sockaddr_un addr;
+    int fd = UnixSocket(path, addr);
+    if (fd < 0) {
+        return false;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+    return Start(fd);
+}
+
+bool BridgeSender::ConnectTcp(const std::string &host, uint16_t port)
+{
+    sockaddr_in addr;
+    if (!TcpAddress(host, port, addr)) {
+        return false;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // batching is ours
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+    return Start(fd);
+}
+
+bool BridgeSender::Start(int fd)
+{
+    std::unique_lock<std::mutex> l(mutex_);
+    if (fd_ >= 0 || closing_) {
+        close(fd);
+        return false;
+    }
+    fd_ = fd;
+    writer_ = std::thread(&BridgeSender::WriterRoutine, this);
+    return true;
+}
+
+void BridgeSender::Forward(uint32_t first, uint32_t last)
+{
+    if (first <= last) {
+        ranges_.emplace_back(first, last);
+    }
+}
+
+bool BridgeSender::Forwarded(uint32_t id) const
+{
+    if (ranges_.empty()) {
+        return true;
+    }
+    for (auto &r : ranges_) {
+        if (id >= r.first && id <= r.second) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BridgeSender::OnEvent(const SpEvent evt)
+{
+    OnEvent(*evt);
+}
+
+void BridgeSender::OnEvent(const Event &evt)
+{
+    if (Forwarded(evt.ID())) {
+        Post(evt.ID(), evt.Priority(), evt.Payload());
+    }
+}
+
+void BridgeSender::OnCEvent(const event_t *evt, void *user_data)
+{
+    BridgeSender *sender = static_cast<BridgeSender*>(user_data);
+    if (sender->Forwarded(evt->id)) {
+        sender->Post(evt->id, FromEvthubPriority(evt->priority),
+                     EventBuffer::Copy(evt->param, evt->size));
+    }
+}
+
+bool BridgeSender::Post(uint32_t id, EvtPriority pri, const EventBuffer &payload)
+{
+    std::unique_lock<std::mutex> l(mutex_);
+    if (queue_.size() >= max_ && !broken_ && !closing_) {
+        stats_.blocked++;
+        writable_.wait(l, [this] { return queue_.size() < max_ || broken_ || closing_; });
+    }
+    if (fd_ < 0 || broken_ || closing_) {
+        stats_.dropped++;
+        return false;
+    }
+    queue_.push_back(Frame{ id, pri, payload });
+    if (queue_.size() == 1) {
+        readable_.notify_one();
+    }
+    return true;
+}
+
+void BridgeSender::Close()
+{
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        if (closing_) {
+            return;
+        }
+        closing_ = true;
+        readable_.notify_one();
+        writable_.notify_all();
+    }
+    // the writer flushes the queue before leaving
+    if (writer_.joinable()) {
+        writer_.join();
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+BridgeStats BridgeSender::GetStats()
+{
+    std::unique_lock<std::mutex> l(mutex_);
+    BridgeStats stats = stats_;
+    stats.queued = queue_.size();
+    return stats;
+}
+
+void BridgeSender::WriterRoutine()
+{
+    std::vector<Frame> batch;
+    batch.reserve(batch_);
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> l(mutex_);
+            readable_.wait(l, [this] { return !queue_.empty() || closing_; });
+            if (queue_.empty()) {
+                return; // closing and flushed
+            }
+            while (batch.size() < batch_ && !queue_.empty()) {
+                batch.push_back(std::move(queue_.front()));
+                queue_.pop_front();
+            }
+            writable_.notify_all();
+        }
+        if (!WriteBatch(batch)) {
+            std::unique_lock<std::mutex> l(mutex_);
+            broken_ = true;
+            stats_.dropped += batch.size() + queue_.size();
+            queue_.clear();
+            writable_.notify_all();
+            return;
+        }
+        batch.clear();
+    }
+}
+
+bool BridgeSender::WriteBatch(std::vector<Frame> &batch)
+{
+    uint8_t headers[IOV_MAX / 2][kBridgeHeader];
+    iovec iov[IOV_MAX];
+    size_t n = 0, total = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        Frame &f = batch[i];
+        EncodeHeader(headers[i], f.id, f.pri, f.payload.Size());
+        iov[n].iov_base = headers[i];
+        iov[n++].iov_len = kBridgeHeader;
+        if (f.payload.Size()) {
+            iov[n].iov_base = const_cast<uint8_t*>(f.payload.Data());
+            iov[n++].iov_len = f.payload.Size();
+        }
+        total += kBridgeHeader + f.payload.Size();
+    }
+
+    // one sendmsg per batch, more only after a partial write
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    size_t left = total;
+    while (left) {
+        ssize_t w = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        left -= w;
+        while (w > 0 && msg.msg_iovlen) {
+            if (static_cast<size_t>(w) >= msg.msg_iov->iov_len) {
+                w -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            } else {
+                msg.msg_iov->iov_base = static_cast<uint8_t*>(msg.msg_iov->iov_base) + w;
+                msg.msg_iov->iov_len -= w;
+                w = 0;
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
+    stats_.frames += batch.size();
+    stats_.batches++;
+    stats_.bytes += total;
+    return true;
+}
+
+BridgeReceiver::BridgeReceiver(EventHub &hub, BridgeFactory factory)
+  : hub_(&hub)
+  , evthub_(nullptr)
+  , factory_(std::move(factory))
+  , max_frame_(kBridgeMaxFrame)
+  , listen_fd_(-1)
+  , wake_{ -1, -1 }
+  , path_()
+  , closing_(false)
+  , mutex_()
+  , stats_()
+  , thread_()
+{
+    if (!factory_) {
+        factory_ = [](uint32_t id, EvtPriority pri, EventBuffer payload) {
+            return SpEvent(new BridgedEvent(id, pri, std::move(payload)));
+        };
+    }
+}
+
+BridgeReceiver::BridgeReceiver(evthub_t hub)
+  : hub_(nullptr)
+  , evthub_(hub)
+  , factory_()
+  , max_frame_(kBridgeMaxFrame)
+  , listen_fd_(-1)
+  , wake_{ -1, -1 }
+  , path_()
+  , closing_(false)
+  , mutex_()
+  , stats_()
+  , thread_()
+{
+}
+
+BridgeReceiver::~BridgeReceiver()
+{
+    Close();
+}
+
+bool BridgeReceiver::ListenUnix(const std::string &path)
+{
+    sockaddr_un addr;
+    int fd = UnixSocket(path, addr);
+    if (fd < 0) {
+        return false;
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+        close(fd);
+        return false;
+    }
+    path_ = path;
+    return Start(fd);
+}
+
+bool BridgeReceiver::ListenTcp(uint16_t port, const std::string &host)
+{
+    sockaddr_in addr;
+    if (!TcpAddress(host, port, addr)) {
+        return false;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+        close(fd);
+        return false;
+    }
+    return Start(fd);
+}
+
+uint16_t BridgeReceiver::Port() const
+{
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (listen_fd_ < 0 || getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0
+        || addr.sin_family != AF_INET) {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+void BridgeReceiver::SetMaxFrame(size_t bytes)
+{
+    max_frame_ = bytes;
+}
+
+bool BridgeReceiver::Start(int fd)
+{
+    if (listen_fd_ >= 0 || pipe2(wake_, O_CLOEXEC) != 0) {
+        close(fd);
+        return false;
+    }
+    listen_fd_ = fd;
+    thread_ = std::thread(&BridgeReceiver::Routine, this);
+    return true;
+}
+
+void BridgeReceiver::Close()
+{
+    if (closing_.exchange(true)) {
+        return;
+    }
+    if (wake_[1] >= 0) {
+        char c = 0;
+        (void)!write(wake_[1], &c, 1);
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    if (listen_fd_ >= 0) {
+        close(listen_fd_);
+        close(wake_[0]);
+        close(wake_[1]);
+    }
+    if (!path_.empty()) {
+        unlink(path_.c_str());
+    }
+}
+
+BridgeStats BridgeReceiver::GetStats()
+{
+    std::unique_lock<std::mutex> l(mutex_);
+    return stats_;
+}
+
+void BridgeReceiver::Routine()
+{
+    pollfd fds[2] = { { listen_fd_, POLLIN, 0 }, { wake_[0], POLLIN, 0 } };
+    while (!closing_) {
+        if (poll(fds, 2, -1) < 0 || fds[1].revents) {
+            continue; // EINTR, or woken by Close
+        }
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            Serve(fd);
+            close(fd);
+        }
+    }
+}
+
+bool BridgeReceiver::ReadFull(int fd, void *buf, size_t n)
+{
+    uint8_t *p = static_cast<uint8_t*>(buf);
+    pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_[0], POLLIN, 0 } };
+    while (n) {
+        ssize_t r = read(fd, p, n);
+        if (r > 0) {
+            p += r;
+            n -= r;
+            continue;
+        } else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+            return false;
+        }
+        poll(fds, 2, -1);
+        if (fds[1].revents) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void BridgeReceiver::Serve(int fd)
+{
+    // non-blocking so Close can interrupt a read through the wake pipe
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[kReadBuffer]);
+    size_t begin = 0, end = 0;
+    pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_[0], POLLIN, 0 } };
+
+    while (!closing_) {
+        // parse every complete frame in the buffer
+        while (end - begin >= kBridgeHeader) {
+            uint32_t id, len;
+            EvtPriority pri;
+            DecodeHeader(buf.get() + begin, id, pri, len);
+            if (len > max_frame_) {
+                std::unique_lock<std::mutex> l(mutex_);
+                stats_.oversized++;
+                return; // a broken or hostile peer
+            }
+            size_t have = std::min<size_t>(end - begin - kBridgeHeader, len);
+            if (have < len && len <= kReadBuffer - kBridgeHeader) {
+                break; // wait for the rest in the buffer
+            }
+            EventBuffer payload = EventBuffer::Allocate(len);
+            if (len && payload.Empty()) {
+                return;
+            }
+            memcpy(payload.MutableData(), buf.get() + begin + kBridgeHeader, have);
+            begin += kBridgeHeader + have;
+            if (have < len && !ReadFull(fd, payload.MutableData() + have, len - have)) {
+                return; // large payload read straight into its buffer
+            }
+            {
+                std::unique_lock<std::mutex> l(mutex_);
+                stats_.frames++;
+                stats_.bytes += kBridgeHeader + len;
+            }
+            Deliver(id, pri, std::move(payload));
+        }
+        if (begin == end) {
+            begin = end = 0;
+        } else if (begin > 0) {
+            memmove(buf.get(), buf.get() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+
+        ssize_t r = read(fd, buf.get() + end, kReadBuffer - end);
+        if (r > 0) {
+            end += r;
+            std::unique_lock<std::mutex> l(mutex_);
+            stats_.batches++;
+        } else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+            return; // peer closed
+        } else if (errno == EAGAIN) {
+            poll(fds, 2, -1);
+        }
+    }
+}
+
+void BridgeReceiver::Deliver(uint32_t id, EvtPriority pri, EventBuffer payload)
+{
+    SpEvent evt;
+    if (hub_) {
+        evt = factory_(id, pri, std::move(payload));
+        if (evt == nullptr) {
+            return;
+        }
+    }
+    // stop reading while the hub is full, the socket fills and the sender
+    // blocks, waking now and then to see Close
+    bool sent = false, waited = false;
+    for (;;) {
+        bool full;
+        if (hub_) {
+            SendStatus s = hub_->SendUntil(evt, std::chrono::steady_clock::now() + kDeliverSlice);
+            sent = s == SendStatus::kSent;
+            full = s == SendStatus::kFull;
+        } else {
+            int s = id > UCHAR_MAX ? UTILS_ERR_PARAM
+                : evthub_send_data_timed(evthub_, static_cast<event_id>(id), ToEvthubPriority(pri),
+                    payload.Data(), payload.Size(),
+                    std::chrono::nanoseconds(kDeliverSlice).count());
+            sent = s == UTILS_SUCC;
+            full = s == UTILS_ERR_TIMEOUT;
+        }
+        if (!full || closing_) {
+            break;
+        }
+        if (!waited) {
+            waited = true;
+            std::unique_lock<std::mutex> l(mutex_);
+            stats_.blocked++;
+        }
+    }
+    if (!sent) {
+        // closed, over a rejecting limit or too large, it never fits
+        std::unique_lock<std::mutex> l(mutex_);
+        stats_.dropped++;
+    }
+}
+
+};
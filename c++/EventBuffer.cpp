@@ -0,0 +1,235 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <new>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <sys/mman.h>
+#include "EventBuffer.h"
+
+namespace utils {
+
+/*! size classes of the slabs, the data of a block follows its header */
+static const size_t kClasses[] = { 256, 1024, 4096, 16384, EventBuffer::kMaxSlab };
+static const size_t kNumClasses = sizeof(kClasses) / sizeof(kClasses[0]);
+static const uint8_t kHeap = kNumClasses;
+static const uint8_t kMapped = kNumClasses + 1;
+static const size_t kSlabBytes = 256 * 1024;    /*!< storage carved at once per class */
+
+struct alignas(16) EventBuffer::Block {
+    std::atomic<uint32_t> refs;
+    uint8_t cls;        /*!< size class, kHeap or kMapped */
+    size_t capacity;    /*!< data bytes */
+    Block *next;        /*!< free list link while in a slab */
+    uint8_t* Data() { return reinterpret_cast<uint8_t*>(this + 1); }
+};
+
+/*! \brief Free lists of released blocks per size class
+ */
+class EventBuffer::SlabPool
+{
+  public:
+    /*! never destroyed, buffers may be released by static destructors */
+    static SlabPool& Get()
+    {
+        static SlabPool *pool = new SlabPool();
+        return *pool;
+    }
+
+    Block* Alloc(size_t size)
+    {
+        size_t c = 0;
+        while (kClasses[c] < size) ++c;
+        Class &cls = classes_[c];
+        std::lock_guard<std::mutex> l(cls.mutex);
+        if (cls.free == nullptr && !Grow(cls, c)) {
+            return nullptr;
+        }
+        Block *b = cls.free;
+        cls.free = b->next;
+        return b;
+    }
+
+    void Free(Block *b)
+    {
+        Class &cls = classes_[b->cls];
+        std::lock_guard<std::mutex> l(cls.mutex);
+        b->next = cls.free;
+        cls.free = b;
+    }
+
+  private:
+    struct Class {
+        std::mutex mutex;
+        Block *free = nullptr;
+        std::vector<std::unique_ptr<uint8_t[]>> slabs;
+    };
+
+    /*! carve a new slab into blocks of class c */
+    bool Grow(Class &cls, size_t c)
+    {
+        size_t stride = sizeof(Block) + kClasses[c];
+        size_t n = std::max<size_t>(kSlabBytes / stride, 1);
+        uint8_t *slab = new (std::nothrow) uint8_t[stride * n + alignof(Block)];
+        if (slab == nullptr) {
+            return false;
+        }
+        cls.slabs.emplace_back(slab);
+        uintptr_t p = (reinterpret_cast<uintptr_t>(slab) + alignof(Block) - 1)
+            & ~static_cast<uintptr_t>(alignof(Block) - 1);
+        for (size_t i = 0; i < n; ++i, p += stride) {
+            Block *b = new (reinterpret_cast<void*>(p)) Block();
+            b->cls = static_cast<uint8_t>(c);
+            b->capacity = kClasses[c];
+            b->next = cls.free;
+            cls.free = b;
+        }
+        return true;
+    }
+
+  private:
+    Class classes_[kNumClasses];
+};
+
+EventBuffer EventBuffer::Allocate(size_t size)
+{
+    Block *b = nullptr;
+    if (size == 0) {
+        return EventBuffer();
+    } else if (size <= kMaxSlab) {
+        b = SlabPool::Get().Alloc(size);
+    } else if (size < kMmapThreshold) {
+        void *p = ::operator new(sizeof(Block) + size, std::nothrow);
+        if (p) {
+            b = new (p) Block();
+            b->cls = kHeap;
+            b->capacity = size;
+        }
+    } else {
+        void *p = mmap(nullptr, sizeof(Block) + size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            b = new (p) Block();
+            b->cls = kMapped;
+            b->capacity = size;
+        }
+    }
+    if (b == nullptr) {
+        return EventBuffer();
+    }
+    b->refs.store(1, std::memory_order_relaxed);
+    return EventBuffer(b, b->Data(), size);
+}
+
+EventBuffer EventBuffer::Copy(const void *data, size_t size)
+{
+    EventBuffer buf = Allocate(size);
+    if (buf.size_) {
+        memcpy(buf.data_, data, size);
+    }
+    return buf;
+}
+
+EventBuffer::EventBuffer(const EventBuffer &orig)
+  : block_(orig.block_), data_(orig.data_), size_(orig.size_)
+{
+    if (block_) {
+        block_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+EventBuffer::EventBuffer(EventBuffer &&orig) noexcept
+  : block_(orig.block_), data_(orig.data_), size_(orig.size_)
+{
+    orig.block_ = nullptr;
+    orig.data_ = nullptr;
+    orig.size_ = 0;
+}
+
+EventBuffer& EventBuffer::operator=(const EventBuffer &orig)
+{
+    if (this != &orig) {
+        EventBuffer copy(orig);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+EventBuffer& EventBuffer::operator=(EventBuffer &&orig) noexcept
+{
+    if (this != &orig) {
+        Release();
+        block_ = orig.block_;
+        data_ = orig.data_;
+        size_ = orig.size_;
+        orig.block_ = nullptr;
+        orig.data_ = nullptr;
+        orig.size_ = 0;
+    }
+    return *this;
+}
+
+EventBuffer::~EventBuffer()
+{
+    Release();
+}
+
+void EventBuffer::Release()
+{
+    Block *b = block_;
+    block_ = nullptr;
+    if (b == nullptr || b->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (b->cls == kMapped) {
+        munmap(b, sizeof(Block) + b->capacity);
+    } else if (b->cls == kHeap) {
+        ::operator delete(b);
+    } else {
+        SlabPool::Get().Free(b);
+    }
+}
+
+EventBuffer EventBuffer::Slice(size_t offset, size_t len) const
+{
+    offset = std::min(offset, size_);
+    len = std::min(len, size_ - offset);
+    if (len == 0) {
+        return EventBuffer();
+    }
+    block_->refs.fetch_add(1, std::memory_order_relaxed);
+    return EventBuffer(block_, data_ + offset, len);
+}
+
+size_t EventBuffer::Capacity() const
+{
+    return block_ ? block_->capacity : 0;
+}
+
+uint32_t EventBuffer::UseCount() const
+{
+    return block_ ? block_->refs.load(std::memory_order_relaxed) : 0;
+}
+
+};
@@ -18,10 +18,301 @@
  * limitations under the License.
  */
 
+#include <deque>
+#include <algorithm>
 #include "EventHub.h"
+#include "evttrace.h"
+#include "probes.h"
 
 namespace utils {
 
+/*! Events popped under one lock while draining */
+static const size_t kDrainBatch = 8;
+/*! time the queue stays empty before adaptive capacity is released */
+static const auto kShrinkIdle = std::chrono::milliseconds(100);
+/*! per id routes kept before they are all rebuilt */
+static const size_t kMaxRoutes = 4096;
+
+/*! \brief Worker pool running the handlers of one event concurrently
+ */
+class EventHub::FanOutPool
+{
+  public:
+    /*! All handler calls of one event, the last one to return completes it */
+    struct Group {
+        Group(Element &&e, size_t n) : e_(std::move(e)), pending_(n), done_(false) {}
+        Element e_;
+        std::atomic<size_t> pending_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        bool done_;
+    };
+    using SpGroup = std::shared_ptr<Group>;
+
+    FanOutPool(EventHub *hub, size_t workers, FanOutDoneCb done)
+      : hub_(hub), mutex_(), cond_(), tasks_(), done_(std::move(done)), exit_(false), threads_()
+    {
+        for (size_t i = 0; i < workers; ++i) {
+            threads_.emplace_back(&FanOutPool::Routine, this);
+        }
+    }
+
+    /*! runs the tasks still queued before the threads exit */
+    ~FanOutPool()
+    {
+        {
+            std::unique_lock<std::mutex> l(mutex_);
+            exit_ = true;
+        }
+        cond_.notify_all();
+        for (auto &t : threads_) {
+            t.join();
+        }
+    }
+
+    /*! \brief Call handlers[0] on this thread and queue the others.
+     */
+    SpGroup Run(Element &&e, const std::vector<EventHandler*> &handlers)
+    {
+        SpGroup g = std::make_shared<Group>(std::move(e), handlers.size() + 1);
+        if (handlers.size() > 1) {
+            {
+                std::unique_lock<std::mutex> l(mutex_);
+                for (size_t i = 1; i < handlers.size(); ++i) {
+                    tasks_.push_back(Task{ handlers[i], g });
+                }
+            }
+            cond_.notify_all();
+        }
+        if (!handlers.empty()) {
+            EventHub::Notify(handlers[0], g->e_);
+            Finish(g);
+        }
+        Finish(g); // the extra count keeps a group without handlers open until here
+        return g;
+    }
+
+    /*! \brief Wait until all handlers of g returned and done was called.
+     */
+    static void Wait(const SpGroup &g)
+    {
+        std::unique_lock<std::mutex> l(g->mutex_);
+        g->cond_.wait(l, [&g] { return g->done_; });
+    }
+
+  private:
+    struct Task {
+        EventHandler *handler;
+        SpGroup group;
+    };
+
+    void Finish(const SpGroup &g)
+    {
+        if (g->pending_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        if (done_) {
+            done_(g->e_.Evt());
+        }
+        {
+            std::unique_lock<std::mutex> l(g->mutex_);
+            g->done_ = true;
+            g->cond_.notify_all();
+        }
+        hub_->Release(1, g->e_.bytes_); // the event held its room until now
+    }
+
+    void Routine()
+    {
+        Task task;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> l(mutex_);
+                cond_.wait(l, [this] { return exit_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            EventHub::Notify(task.handler, task.group->e_);
+            Finish(task.group);
+            task.group.reset();
+        }
+    }
+
+  private:
+    EventHub *hub_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Task> tasks_;
+    FanOutDoneCb done_;
+    bool exit_;
+    std::vector<std::thread> threads_;
+};
+
+/*! \brief Watches the handler call in progress on the hub thread
+ */
+class EventHub::Watchdog
+{
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    Watchdog(std::chrono::microseconds budget, SlowCallCb report, EventHub *hub)
+      : budget_(budget), report_(std::move(report)), hub_(hub)
+      , seq_(0), handler_(nullptr), id_(0), start_(0), limit_(0), claimed_(0)
+      , wake_at_(Clock::time_point::max().time_since_epoch().count())
+      , mutex_(), cond_(), kicked_(false), exit_(false), thread_()
+    {
+        thread_ = std::thread(&Watchdog::Routine, this);
+    }
+
+    ~Watchdog()
+    {
+        {
+            std::unique_lock<std::mutex> l(mutex_);
+            exit_ = true;
+        }
+        cond_.notify_one();
+        thread_.join();
+    }
+
+    std::chrono::microseconds Budget() const { return budget_; }
+    const SlowCallCb& Report() const { return report_; }
+
+    /*! publish the call about to start under a seqlock, plain stores
+     *  unless the watchdog sleeps past the new deadline
+     *  \return number of the call, for Leave */
+    uint64_t Enter(EventHandler *handler, uint32_t id, Clock::time_point start,
+                   std::chrono::microseconds budget)
+    {
+        uint64_t seq = seq_.load(std::memory_order_relaxed);
+        seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        handler_.store(handler, std::memory_order_relaxed);
+        id_.store(id, std::memory_order_relaxed);
+        start_.store(start.time_since_epoch().count(), std::memory_order_relaxed);
+        limit_.store(budget.count(), std::memory_order_relaxed);
+        seq_.store(seq + 2, std::memory_order_seq_cst);
+
+        auto deadline = start + budget;
+        if (deadline.time_since_epoch().count() < wake_at_.load(std::memory_order_seq_cst)) {
+            std::unique_lock<std::mutex> l(mutex_);
+            kicked_ = true;
+            cond_.notify_one();
+        }
+        return seq + 2;
+    }
+
+    /*! \return whether the watchdog already flagged this call */
+    bool Leave(uint64_t call)
+    {
+        return claimed_.exchange(call, std::memory_order_acq_rel) == call;
+    }
+
+  private:
+    /*! \brief Consistent copy of the published call */
+    struct Call {
+        uint64_t seq;
+        EventHandler *handler;
+        uint32_t id;
+        Clock::time_point start;
+        Clock::time_point deadline;
+    };
+
+    /*! \return false if no call is running or it was claimed already */
+    bool Current(Call &c) const
+    {
+        for (;;) {
+            uint64_t seq = seq_.load(std::memory_order_seq_cst);
+            if (seq & 1) {
+                std::this_thread::yield(); // a few stores away from done
+                continue;
+            }
+            if (seq == 0) {
+                return false;
+            }
+            c.seq = seq;
+            c.handler = handler_.load(std::memory_order_relaxed);
+            c.id = id_.load(std::memory_order_relaxed);
+            c.start = Clock::time_point(Clock::duration(start_.load(std::memory_order_relaxed)));
+            c.deadline = c.start + std::chrono::microseconds(limit_.load(std::memory_order_relaxed));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq_.load(std::memory_order_relaxed) == seq) {
+                return claimed_.load(std::memory_order_acquire) < seq;
+            }
+        }
+    }
+
+    /*! report c unless Leave or an earlier check claimed it */
+    void Flag(const Call &c)
+    {
+        uint64_t claimed = claimed_.load(std::memory_order_acquire);
+        do {
+            if (claimed >= c.seq) {
+                return;
+            }
+        } while (!claimed_.compare_exchange_weak(claimed, c.seq, std::memory_order_acq_rel));
+        SlowCall call;
+        call.handler = c.handler;
+        call.id = c.id;
+        call.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - c.start);
+        call.running = true;
+        call.isolated = false;
+        hub_->OnStall();
+        if (report_) {
+            report_(call);
+        }
+    }
+
+    /*! sleep until a call starts, then until its deadline */
+    void Routine()
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        while (!exit_) {
+            Call c, again;
+            bool running = Current(c);
+            auto wake = running ? c.deadline : Clock::time_point::max();
+            if (running && Clock::now() >= wake) {
+                l.unlock();
+                Flag(c);
+                l.lock();
+                continue;
+            }
+            kicked_ = false;
+            wake_at_.store(wake.time_since_epoch().count(), std::memory_order_seq_cst);
+            // a call entered since the first read either sees wake_at_ or is seen here
+            bool now = Current(again);
+            if (now != running || (now && again.seq != c.seq)) {
+                continue;
+            }
+            if (running) {
+                cond_.wait_until(l, wake, [this] { return exit_ || kicked_; });
+            } else {
+                cond_.wait(l, [this] { return exit_ || kicked_; });
+            }
+        }
+    }
+
+  private:
+    std::chrono::microseconds budget_;
+    SlowCallCb report_;
+    EventHub *hub_;
+    std::atomic<uint64_t> seq_;             /*!< odd while Enter writes, even once the call is published */
+    std::atomic<EventHandler*> handler_;
+    std::atomic<uint32_t> id_;
+    std::atomic<Clock::rep> start_;
+    std::atomic<std::chrono::microseconds::rep> limit_;
+    std::atomic<uint64_t> claimed_;         /*!< last call flagged or left */
+    std::atomic<Clock::rep> wake_at_;       /*!< time the watchdog sleeps until */
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool kicked_;                           /*!< a call starts before wake_at_ */
+    bool exit_;
+    std::thread thread_;
+};
+
 EventHub::EventHub(size_t max)
   : e_mutex_()
   , h_mutex_()
@@ -29,24 +320,59 @@ EventHub::EventHub(size_t max)
   , seq_no_(0)
   , evtque_()
   , max_size_(max)
+  , soft_size_(max)
+  , hard_size_(max)
+  , step_size_(0)
+  , byte_budget_(0)
+  , bytes_(0)
+  , high_mark_(0)
+  , low_mark_(0)
+  , above_high_(false)
+  , marked_high_(false)
+  , marking_(false)
+  , on_high_()
+  , on_low_()
+  , stats_()
   , handlers_()
-  , thread_(new std::thread(&EventHub::StartRoutine, this))
+  , all_()
+  , narrowed_(0)
+  , routes_()
+  , matches_()
+  , targets_()
+  , filtered_(0)
   , exit_(false)
+  , draining_(false)
+  , inflight_(0)
+  , dispatched_(0)
+  , drain_cond_()
+  , space_cond_()
+  , space_waiters_(0)
+  , space_gen_(0)
+  , batch_()
+  , trace_(nullptr)
+  , limits_(nullptr)
+  , limited_(0)
+  , l_mutex_()
+  , limiters_()
+  , limit_maps_()
+  , fanout_()
+  , watchdog_()
+  , isolated_()
+  , isolate_after_(0)
+  , fanout_ordered_(false)
+  , fanout_handlers_()
+  , start_once_()
+  , thread_()
+  , joinable_(false)
 {
+    stats_.capacity = max;
 }
 
 EventHub::EventHub(EventHandler *handler, size_t max)
-  : e_mutex_()
-  , h_mutex_()
-  , cond_()
-  , seq_no_(0)
-  , evtque_()
-  , max_size_(max)
-  , handlers_()
-  , thread_(new std::thread(&EventHub::StartRoutine, this))
-  , exit_(false)
+  : EventHub(max)
 {
-    handlers_.emplace(handler);
+    handlers_[handler];
+    Reroute();
 }
 
 EventHub::~EventHub()
@@ -55,20 +381,63 @@ EventHub::~EventHub()
         std::unique_lock<std::mutex> l(e_mutex_);
         exit_ = true;
         cond_.notify_one();
+        space_cond_.notify_all();
     }
-    if (thread_->joinable()) {
-        thread_->join();
+    JoinThread();
+    fanout_.reset();
+    watchdog_.reset();
+    isolated_.reset();
+    SetTrace(nullptr);
+}
+
+bool EventHub::Start(const thread_attr *attr)
+{
+    bool applied = false;
+    std::call_once(start_once_, [this, attr, &applied] {
+        applied = thread_spawn(&thread_, attr, -1, &EventHub::ThreadRoutine, this) == UTILS_SUCC;
+        if (!applied && attr) {
+            joinable_ = thread_spawn(&thread_, nullptr, -1, &EventHub::ThreadRoutine, this)
+                == UTILS_SUCC;
+        } else {
+            joinable_ = applied;
+        }
+    });
+    return applied;
+}
+
+bool EventHub::SetThread(const thread_attr &attr)
+{
+    return Start(&attr);
+}
+
+void EventHub::JoinThread()
+{
+    if (joinable_) {
+        pthread_join(thread_, nullptr);
+        joinable_ = false;
     }
 }
 
 bool EventHub::Subscribe(EventHandler * handler)
 {
-    if (handler == nullptr) {
+    return Subscribe(handler, 0, UINT32_MAX);
+}
+
+bool EventHub::Subscribe(EventHandler *handler, uint32_t first, uint32_t last, SpFilter filter)
+{
+    if (handler == nullptr || first > last) {
         return false;
     }
 
     std::unique_lock<std::mutex> l(h_mutex_);
-    handlers_.emplace(handler);
+    HandlerInfo &info = handlers_[handler];
+    info.first = first;
+    info.last = last;
+    info.filter = std::move(filter);
+    if (info.isolated) {
+        isolated_->Subscribe(handler, first, last, info.filter);
+    }
+    Reroute();
     return true;
 }
 
@@ -84,41 +453,484 @@ bool EventHub::UnSubscribe(EventHandler * handler)
         return false;
     }
 
+    if (it->second.isolated) {
+        isolated_->UnSubscribe(handler);
+    }
     handlers_.erase(it);
+    Reroute();
     return true;
 }
 
+void EventHub::Reroute()
+{
+    all_.handlers.clear();
+    narrowed_ = 0;
+    for (auto &h : handlers_) {
+        if (h.first == nullptr) {
+            continue;
+        }
+        all_.handlers.emplace_back(h.first, &h.second);
+        if (h.second.first != 0 || h.second.last != UINT32_MAX || h.second.filter) {
+            narrowed_++;
+        }
+    }
+    routes_.clear();
+}
+
+const EventHub::Targets& EventHub::Select(const Element &e)
+{
+    if (narrowed_ == 0) {
+        return all_.handlers;
+    }
+    uint32_t id = e.Evt().ID();
+    auto it = routes_.find(id);
+    if (it == routes_.end()) {
+        if (routes_.size() >= kMaxRoutes) {
+            routes_.clear();
+        }
+        Route r;
+        for (auto &h : all_.handlers) {
+            const HandlerInfo &info = *h.second;
+            if (id < info.first || id > info.last) {
+                continue;
+            }
+            int slot = -1;
+            if (info.filter) {
+                auto f = std::find(r.filters.begin(), r.filters.end(), info.filter.get());
+                slot = static_cast<int>(f - r.filters.begin());
+                if (f == r.filters.end()) {
+                    r.filters.push_back(info.filter.get());
+                }
+            }
+            r.handlers.push_back(h);
+            r.slots.push_back(slot);
+        }
+        it = routes_.emplace(id, std::move(r)).first;
+    }
+    const Route &r = it->second;
+    if (r.filters.empty()) {
+        return r.handlers;
+    }
+
+    // evaluate every distinct filter once, then pick the handlers
+    matches_.resize(r.filters.size());
+    for (size_t i = 0; i < r.filters.size(); ++i) {
+        matches_[i] = r.filters[i]->Evaluate(e.Evt());
+    }
+    targets_.clear();
+    for (size_t i = 0; i < r.handlers.size(); ++i) {
+        if (r.slots[i] < 0 || matches_[r.slots[i]]) {
+            targets_.push_back(r.handlers[i]);
+        }
+    }
+    if (targets_.size() < r.handlers.size()) {
+        filtered_.fetch_add(r.handlers.size() - targets_.size(), std::memory_order_relaxed);
+    }
+    return targets_;
+}
+
 bool EventHub::Send(const SpEvent &evt)
 {
     if (evt == nullptr) return false;
+    return Push(Element(evt, 0)) == SendStatus::kSent;
+}
+
+bool EventHub::Send(UpEvent &&evt)
+{
+    if (evt == nullptr) return false;
+    Element e(std::move(evt), 0);
+    if (Push(std::move(e)) != SendStatus::kSent) {
+        evt = std::move(e.uevt_); // give it back to the caller
+        return false;
+    }
+    return true;
+}
+
+SendStatus EventHub::SendUntil(const SpEvent &evt, std::chrono::steady_clock::time_point deadline)
+{
+    if (evt == nullptr) return SendStatus::kRefused;
+    SendStatus s = Push(Element(evt, 0));
+    if (s != SendStatus::kFull) {
+        return s;
+    }
+    // announce the waiter before retrying, the fence pairs with the one
+    // after the internal thread releases bytes
+    space_waiters_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (;;) {
+        uint64_t gen;
+        {
+            std::unique_lock<std::mutex> l(e_mutex_);
+            gen = space_gen_;
+        }
+        s = Push(Element(evt, 0), false);
+        if (s != SendStatus::kFull) {
+            break;
+        }
+        std::unique_lock<std::mutex> l(e_mutex_);
+        if (!space_cond_.wait_until(l, deadline, [this, gen] {
+                return exit_ || draining_ || space_gen_ != gen; })) {
+            break;
+        }
+    }
+    space_waiters_.fetch_sub(1, std::memory_order_relaxed);
+    return s;
+}
+
+SendStatus EventHub::Push(Element &&e, bool admit)
+{
+    size_t depth = 0;
+    bool high = false;
+    FILE *trace = trace_.load(std::memory_order_acquire);
+    uint32_t id = 0;
+    uint8_t trace_pri = 0;
+    size_t bytes = e.bytes_;
+    if (trace) {
+        id = e.uevt_ ? e.uevt_->ID() : e.evt_->ID();
+        trace_pri = ToEvthubPriority(e.pri_); // traces use evthub priorities
+    }
+    uint8_t pri = static_cast<uint8_t>(e.pri_);
+
+    // one load when there are no limits
+    bool conflate = false;
+    const LimitMap *limits = admit ? limits_.load(std::memory_order_acquire) : nullptr;
+    if (limits) {
+        uint32_t eid = e.Evt().ID();
+        auto it = std::upper_bound(limits->begin(), limits->end(), eid,
+            [](uint32_t v, const Limiter *lim) { return v < lim->first; });
+        if (it != limits->begin() && eid <= (*--it)->last && !(*it)->Admit()) {
+            limited_.fetch_add(1, std::memory_order_relaxed);
+            EVTHUB_PROBE(eventhub, reject, eid, pri, EVTHUB_REJECT_LIMITED);
+            if ((*it)->action != LimitAction::kConflate) {
+                return (*it)->action == LimitAction::kDrop ? SendStatus::kSent : SendStatus::kRefused;
+            }
+            conflate = true;
+        }
+    }
+
+    Start();
     {
         std::unique_lock<std::mutex> l(e_mutex_);
-        if (evtque_.size() >= max_size_) {
-            return false; // Event hub is full.
+        if (exit_ || draining_) {
+            stats_.rejected++;
+            EVTHUB_PROBE(eventhub, reject, e.Evt().ID(), pri, EVTHUB_REJECT_CLOSED);
+            return SendStatus::kClosed; // Event hub is stopping.
+        }
+        // a conflated event takes the place of a pending one
+        Element *pending = conflate ? evtque_.Pending(e) : nullptr;
+        // unfinished fan-out events still hold their room
+        size_t held = fanout_ ? inflight_.load(std::memory_order_relaxed) : 0;
+        if (pending == nullptr && evtque_.size() + held >= max_size_) {
+            if (max_size_ >= hard_size_) {
+                stats_.rejected++;
+                EVTHUB_PROBE(eventhub, reject, e.Evt().ID(), pri, EVTHUB_REJECT_FULL);
+                return SendStatus::kFull; // Event hub is full.
+            }
+            max_size_ = std::min(max_size_ + step_size_, hard_size_);
+            stats_.grows++;
+        }
+        // the hub thread only ever lowers bytes_, so the check holds
+        size_t replaced = pending ? pending->bytes_ : 0;
+        size_t total = bytes_.load(std::memory_order_relaxed) + bytes - replaced;
+        if (byte_budget_ && total > byte_budget_) {
+            stats_.rejected++;
+            EVTHUB_PROBE(eventhub, reject, e.Evt().ID(), pri, EVTHUB_REJECT_BYTES);
+            // it never fits if it alone is over the budget
+            return bytes - replaced > byte_budget_ ? SendStatus::kRefused : SendStatus::kFull;
+        }
+        bytes_.fetch_add(bytes - replaced, std::memory_order_relaxed);
+        stats_.peak_bytes = std::max(stats_.peak_bytes, total);
+        if (pending) {
+            EvtQueue::Conflate(*pending, e); // e holds the old event, freed outside the lock
+        } else {
+            e.seq_ = seq_no_++;
+            EVTHUB_PROBE(eventhub, enqueue, e.Evt().ID(), pri, evtque_.size() + 1);
+            evtque_.push(std::move(e));
+            depth = evtque_.size();
+            stats_.sent++;
+            stats_.peak_depth = std::max(stats_.peak_depth, depth);
+            if (high_mark_ && !above_high_ && depth >= high_mark_) {
+                above_high_ = high = true;
+                stats_.high_marks++;
+            }
         }
-        evtque_.emplace(evt, seq_no_++);
     }
 #ifndef TEST_ON
     cond_.notify_one();
 #endif
+    if (trace) {
+        evttrace_write(trace, id, trace_pri, static_cast<uint32_t>(
+            std::min<size_t>(bytes, UINT32_MAX)));
+    }
+    // outside the lock, the callback may well Send
+    if (high) {
+        DeliverMarks();
+    }
 
+    return SendStatus::kSent;
+}
+
+bool EventHub::OnPopped(size_t n)
+{
+    stats_.dispatched += n;
+    if (above_high_ && evtque_.size() <= low_mark_) {
+        above_high_ = false;
+        stats_.low_marks++;
+        return true;
+    }
+    return false;
+}
+
+void EventHub::DeliverMarks()
+{
+    std::unique_lock<std::mutex> l(e_mutex_);
+    if (marking_) {
+        return; // that thread reports this edge too before it leaves
+    }
+    marking_ = true;
+    while (marked_high_ != above_high_) {
+        marked_high_ = above_high_;
+        size_t depth = evtque_.size();
+        l.unlock();
+        if (marked_high_) {
+            on_high_(depth);
+        } else {
+            on_low_(depth);
+        }
+        l.lock();
+    }
+    marking_ = false;
+}
+
+bool EventHub::SetWatermarks(size_t high, size_t low, WatermarkCb on_high, WatermarkCb on_low)
+{
+    if (high == 0 || low >= high || !on_high || !on_low) {
+        return false;
+    }
+    std::unique_lock<std::mutex> l(e_mutex_);
+    high_mark_ = high;
+    low_mark_ = low;
+    on_high_ = std::move(on_high);
+    on_low_ = std::move(on_low);
+    return true;
+}
+
+bool EventHub::Limiter::Admit() const
+{
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t t = tat.load(std::memory_order_relaxed);
+    int64_t next;
+    do {
+        next = std::max(t, now) + interval;
+        if (next - now > span) {
+            return false;
+        }
+    } while (!tat.compare_exchange_weak(t, next, std::memory_order_relaxed));
+    return true;
+}
+
+bool EventHub::SetLimit(uint32_t first, uint32_t last, double rate, size_t burst,
+                        LimitAction action)
+{
+    if (first > last || rate < 0 || (rate > 0 && burst == 0)) {
+        return false;
+    }
+    std::unique_lock<std::mutex> l(l_mutex_);
+    const LimitMap *cur = limits_.load(std::memory_order_relaxed);
+    std::unique_ptr<LimitMap> map(new LimitMap());
+    if (cur) {
+        for (auto lim : *cur) {
+            if (lim->first == first && lim->last == last) {
+                continue; // replaced or removed
+            } else if (lim->first <= last && first <= lim->last) {
+                return false;
+            }
+            map->push_back(lim);
+        }
+    }
+    if (rate > 0) {
+        std::unique_ptr<Limiter> lim(new Limiter());
+        lim->first = first;
+        lim->last = last;
+        lim->interval = std::max<int64_t>(static_cast<int64_t>(1e9 / rate), 1);
+        lim->span = lim->interval * static_cast<int64_t>(burst);
+        lim->action = action;
+        lim->tat.store(0, std::memory_order_relaxed);
+        auto pos = std::upper_bound(map->begin(), map->end(), first,
+            [](uint32_t v, const Limiter *x) { return v < x->first; });
+        map->insert(pos, lim.get());
+        limiters_.push_back(std::move(lim));
+    }
+    const LimitMap *next = map->empty() ? nullptr : map.get();
+    limit_maps_.push_back(std::move(map));
+    limits_.store(next, std::memory_order_release);
+    return true;
+}
+
+void EventHub::SetByteBudget(size_t bytes)
+{
+    std::unique_lock<std::mutex> l(e_mutex_);
+    byte_budget_ = bytes;
+}
+
+bool EventHub::SetAdaptive(size_t soft, size_t hard, size_t step)
+{
+    if (soft == 0 || soft > hard || step == 0) {
+        return false;
+    }
+    std::unique_lock<std::mutex> l(e_mutex_);
+    soft_size_ = max_size_ = soft;
+    hard_size_ = hard;
+    step_size_ = step;
+    return true;
+}
+
+bool EventHub::SetTrace(const char *path)
+{
+    FILE *f = nullptr;
+    if (path && (f = evttrace_open(path)) == nullptr) {
+        return false;
+    }
+    f = trace_.exchange(f);
+    if (f) {
+        fclose(f);
+    }
     return true;
 }
 
+bool EventHub::SetWatchdog(std::chrono::microseconds budget, SlowCallCb report,
+                           size_t isolate_after)
+{
+    if (budget.count() <= 0 || watchdog_) {
+        return false;
+    }
+    if (isolate_after) {
+        isolated_.reset(new EventHub(max_size_));
+        isolate_after_ = isolate_after;
+    }
+    watchdog_.reset(new Watchdog(budget, std::move(report), this));
+    return true;
+}
+
+bool EventHub::SetBudget(EventHandler *handler, std::chrono::microseconds budget)
+{
+    std::unique_lock<std::mutex> l(h_mutex_);
+    auto it = handlers_.find(handler);
+    if (it == handlers_.end() || budget.count() <= 0) {
+        return false;
+    }
+    it->second.budget = budget;
+    return true;
+}
+
+size_t EventHub::SlowCalls(EventHandler *handler)
+{
+    std::unique_lock<std::mutex> l(h_mutex_);
+    auto it = handlers_.find(handler);
+    return it == handlers_.end() ? 0 : it->second.slow_calls;
+}
+
+void EventHub::OnStall()
+{
+    std::unique_lock<std::mutex> l(e_mutex_);
+    stats_.stalls++;
+}
+
+void EventHub::TimedNotify(EventHandler *handler, HandlerInfo &info, Element &e)
+{
+    auto budget = info.budget.count() ? info.budget : watchdog_->Budget();
+    uint32_t id = e.Evt().ID();
+    auto start = Watchdog::Clock::now();
+    uint64_t seq = watchdog_->Enter(handler, id, start, budget);
+    Notify(handler, e);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        Watchdog::Clock::now() - start);
+    bool flagged = watchdog_->Leave(seq);
+    if (elapsed <= budget) {
+        return;
+    }
+
+    SlowCall call = { handler, id, elapsed, false, false };
+    if (++info.slow_calls == isolate_after_) {
+        info.isolated = call.isolated = true;
+        isolated_->Subscribe(handler, info.first, info.last, info.filter);
+    }
+    {
+        std::unique_lock<std::mutex> l(e_mutex_);
+        stats_.slow_calls++;
+        stats_.isolated += call.isolated ? 1 : 0;
+    }
+    // a stall the watchdog reported is not reported again, unless it isolates
+    if (watchdog_->Report() && (!flagged || call.isolated)) {
+        watchdog_->Report()(call);
+    }
+}
+
+bool EventHub::SetFanOut(size_t workers, bool ordered, FanOutDoneCb done)
+{
+    if (workers == 0 || fanout_) {
+        return false;
+    }
+    fanout_.reset(new FanOutPool(this, workers, std::move(done)));
+    fanout_ordered_ = ordered;
+    return true;
+}
+
+HubStats EventHub::GetStats()
+{
+    std::unique_lock<std::mutex> l(e_mutex_);
+    HubStats stats = stats_;
+    stats.depth = evtque_.size();
+    stats.capacity = max_size_;
+    stats.bytes = bytes_.load(std::memory_order_relaxed);
+    stats.byte_budget = byte_budget_;
+    stats.limited = limited_.load(std::memory_order_relaxed);
+    stats.filtered = filtered_.load(std::memory_order_relaxed);
+    return stats;
+}
+
 void EventHub::Cancel()
 {
     std::unique_lock<std::mutex> l(e_mutex_);
     exit_ = true;
     cond_.notify_one();
+    space_cond_.notify_all();
+}
+
+DrainResult EventHub::Drain(std::chrono::steady_clock::time_point deadline)
+{
+    DrainResult r = { 0, 0 };
+    Start();
+    {
+        std::unique_lock<std::mutex> l(e_mutex_);
+        if (exit_ || draining_) {
+            return r;
+        }
+        draining_ = true;
+        cond_.notify_one();
+        space_cond_.notify_all();
+        drain_cond_.wait_until(l, deadline, [this] {
+            return evtque_.empty() && inflight_ == 0;
+        });
+        r.dropped = evtque_.size();
+        bytes_.fetch_sub(evtque_.Bytes(), std::memory_order_relaxed);
+        evtque_ = EvtQueue();
+        exit_ = true;
+        cond_.notify_one();
+    }
+    JoinThread();
+    /*! the batch in hand at the deadline is still dispatched */
+    r.dispatched = dispatched_;
+    return r;
 }
 
 #ifdef TEST_ON
 void EventHub::Signal() { cond_.notify_one(); }
 
 void EventHub::Join() {
-    if (thread_->joinable()) {
-        thread_->join();
-    }
+    Start();
+    JoinThread();
 }
 #endif
 
@@ -127,37 +939,205 @@ void EventHub::StartRoutine()
     while (EventLoop());
 }
 
+void* EventHub::ThreadRoutine(void *arg)
+{
+    static_cast<EventHub*>(arg)->StartRoutine();
+    return nullptr;
+}
+
 bool EventHub::EventLoop()
 {
-    Element e;
+    size_t bytes = 0;
+    bool low = false;
     {
         std::unique_lock<std::mutex> l(e_mutex_);
         if (exit_) return false;
         if (evtque_.empty()) {
             seq_no_= 0; // reset sequence number
-            cond_.wait(l);
+            EVTHUB_PROBE(eventhub, park, 0, 0, 0);
+            if (max_size_ <= soft_size_) {
+                cond_.wait(l);
+            } else if (!cond_.wait_for(l, kShrinkIdle, [this] { return exit_ || !evtque_.empty(); })) {
+                // grown capacity goes only once the queue stayed empty,
+                // so bursts do not pay a grow and reallocation each
+                max_size_ = soft_size_;
+                evtque_.ShrinkToFit();
+                stats_.shrinks++;
+            }
+            EVTHUB_PROBE(eventhub, unpark, 0, 0, evtque_.size());
             return true;
         } else {
-            e = evtque_.top();
-            evtque_.pop();
+            // pop one event, or a batch while draining
+            size_t n = draining_ ? kDrainBatch : 1;
+            while (n-- && !evtque_.empty()) {
+                EVTHUB_PROBE(eventhub, dequeue, evtque_.top().Evt().ID(),
+                             static_cast<int>(evtque_.top().pri_), evtque_.size() - 1);
+                // move out of top(), pop() only compares cached fields
+                bytes += evtque_.top().bytes_;
+                batch_.push_back(std::move(const_cast<Element&>(evtque_.top())));
+                evtque_.pop();
+            }
+            inflight_.fetch_add(batch_.size(), std::memory_order_relaxed);
+            low = OnPopped(batch_.size());
         }
     }
 
+    if (low) {
+        DeliverMarks();
+    }
+
     h_mutex_.lock();
-    for (auto handler : handlers_) {
-        if (handler) {
-            handler->OnEvent(e.evt_);
+    for (auto &e : batch_) {
+        const Targets &targets = Select(e);
+        if (fanout_) {
+            // share up front, handlers run on several threads at once
+            if (e.uevt_) {
+                e.evt_ = SpEvent(std::move(e.uevt_));
+            }
+            fanout_handlers_.clear();
+            for (auto &h : targets) {
+                fanout_handlers_.push_back(h.first);
+            }
+            auto group = fanout_->Run(std::move(e), fanout_handlers_);
+            if (fanout_ordered_) {
+                FanOutPool::Wait(group);
+            }
+            continue;
+        }
+        if (!watchdog_) {
+            for (auto &h : targets) {
+                Notify(h.first, e);
+            }
+            continue;
+        }
+        bool forward = false;
+        for (auto &h : targets) {
+            if (h.second->isolated) {
+                forward = true; // the isolated hub filters it again
+            } else {
+                TimedNotify(h.first, *h.second, e); // handled here this time
+            }
+        }
+        if (forward) {
+            // the isolated hub shares the event
+            if (e.uevt_) {
+                e.evt_ = SpEvent(std::move(e.uevt_));
+            }
+            if (!isolated_->Send(e.evt_)) {
+                std::unique_lock<std::mutex> l(e_mutex_);
+                stats_.isolated_drops++;
+            }
         }
     }
     h_mutex_.unlock();
 
+    // fan-out events are released by their group once the last handler returns
+    size_t n = fanout_ ? 0 : batch_.size();
+    batch_.clear();
+    Release(n, fanout_ ? 0 : bytes);
     return true;
 }
 
+void EventHub::Release(size_t n, size_t bytes)
+{
+    inflight_.fetch_sub(n, std::memory_order_relaxed);
+    bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    // wake SendUntil after the room is released, the fence pairs with
+    // the one after a waiter is counted
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (space_waiters_.load(std::memory_order_relaxed)) {
+        std::unique_lock<std::mutex> l(e_mutex_);
+        space_gen_++;
+        space_cond_.notify_all();
+    }
+    // only a draining hub waits for the count, keep the lock off the normal path
+    if (draining_) {
+        std::unique_lock<std::mutex> l(e_mutex_);
+        dispatched_ += n;
+        drain_cond_.notify_one();
+    }
+}
+
+void EventHub::Notify(EventHandler *handler, Element &e)
+{
+    EVTHUB_PROBE(eventhub, handler_entry, e.Evt().ID(), static_cast<int>(e.pri_), handler);
+    if (e.unique_) {
+        const Event &evt = e.Evt();
+        UniqueDispatch d(e.uevt_, e.evt_);
+        handler->OnEvent(evt);
+    } else {
+        handler->OnEvent(e.evt_);
+    }
+    EVTHUB_PROBE(eventhub, handler_exit, e.Evt().ID(), static_cast<int>(e.pri_), handler);
+}
+
+SpFilter EventFilter::Predicate(FilterFn fn)
+{
+    return fn ? SpFilter(new EventFilter(std::move(fn), {})) : nullptr;
+}
+
+SpFilter EventFilter::Match(std::vector<FieldMatch> terms)
+{
+    return SpFilter(new EventFilter(nullptr, std::move(terms)));
+}
+
+bool EventFilter::Evaluate(const Event &evt) const
+{
+    if (fn_) {
+        return fn_(evt);
+    }
+    for (auto &t : terms_) {
+        int64_t v;
+        if (!evt.GetField(t.field.c_str(), v)) {
+            return false;
+        }
+        bool match = false;
+        switch (t.op) {
+            case FieldOp::kEq: match = v == t.value; break;
+            case FieldOp::kNe: match = v != t.value; break;
+            case FieldOp::kLt: match = v < t.value; break;
+            case FieldOp::kLe: match = v <= t.value; break;
+            case FieldOp::kGt: match = v > t.value; break;
+            case FieldOp::kGe: match = v >= t.value; break;
+        }
+        if (!match) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*! innermost unique dispatch on this thread */
+static thread_local UniqueDispatch *t_dispatch = nullptr;
+
+UniqueDispatch::UniqueDispatch(UpEvent &unique, SpEvent &shared)
+  : unique_(unique), shared_(shared), prev_(t_dispatch)
+{
+    t_dispatch = this;
+}
+
+UniqueDispatch::~UniqueDispatch()
+{
+    t_dispatch = prev_;
+}
+
+SpEvent EventHandler::Share(const Event &evt)
+{
+    UniqueDispatch *d = t_dispatch;
+    if (d && d->unique_.get() == &evt) {
+        d->shared_ = SpEvent(std::move(d->unique_));
+    }
+    if (d && d->shared_.get() == &evt) {
+        return d->shared_;
+    }
+    // called by no hub, the caller owns evt
+    return SpEvent(SpEvent(), const_cast<Event*>(&evt));
+}
+
 bool EventHub::Element::operator<(const Element &orig) const
 {
-    if (evt_->Priority() != orig.evt_->Priority()) {
-        return evt_->Priority() > orig.evt_->Priority();
+    if (pri_ != orig.pri_) {
+        return pri_ > orig.pri_;
     } else {
         return seq_ > orig.seq_;
     }
@@ -0,0 +1,72 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "HubRegistry.h"
+
+namespace utils {
+
+HubRegistry::HubRegistry()
+  : mutex_()
+  , map_(nullptr)
+  , snapshots_()
+  , hubs_()
+{
+    snapshots_.emplace_back(new HubMap());
+    map_.store(snapshots_.back().get(), std::memory_order_release);
+}
+
+HubRegistry::~HubRegistry()
+{
+    // hubs join their threads before the snapshots naming them go away
+    hubs_.clear();
+}
+
+EventHub* HubRegistry::Find(const std::string &name) const
+{
+    const HubMap *map = map_.load(std::memory_order_acquire);
+    auto it = map->find(name);
+    return it == map->end() ? nullptr : it->second;
+}
+
+EventHub& HubRegistry::Get(const std::string &name, size_t max)
+{
+    EventHub *hub = Find(name);
+    if (hub) {
+        return *hub;
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
+    hub = Find(name);
+    if (hub) {
+        return *hub; // created by another thread meanwhile
+    }
+    hubs_.emplace_back(new EventHub(max));
+    hub = hubs_.back().get();
+
+    // publish a copy, readers may still hold the old snapshot
+    std::unique_ptr<HubMap> map(new HubMap(*map_.load(std::memory_order_relaxed)));
+    map->emplace(name, hub);
+    map_.store(map.get(), std::memory_order_release);
+    snapshots_.emplace_back(std::move(map));
+    return *hub;
+}
+
+};
@@ -0,0 +1,341 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <mutex>
+#include <condition_variable>
+#include "Pipeline.h"
+
+namespace utils {
+
+/*! \brief Bounded MPMC queue, Vyukov's sequence numbered cells.
+ *
+ *  Push and pop never lock. Threads only take the mutex to sleep on a
+ *  full or empty queue, and the other side only takes it when the
+ *  waiter count says someone sleeps.
+ */
+class Pipeline::Queue
+{
+  public:
+    explicit Queue(size_t capacity)
+      : mask_(0), cells_(), head_(0), tail_(0), closed_(false)
+      , mutex_(), readable_(), writable_(), readers_(0), writers_(0)
+    {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        mask_ = size - 1;
+        cells_.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t Capacity() const { return mask_ + 1; }
+
+    size_t Size() const
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    /*! push all n events, blocks while full, wakes readers once
+     *  \return times it blocked */
+    uint64_t Push(SpEvent *evts, size_t n)
+    {
+        uint64_t stalls = 0;
+        for (size_t i = 0; i < n; ) {
+            if (TryPush(evts[i])) {
+                ++i;
+                continue;
+            }
+            // let readers see what was pushed so far before sleeping
+            Wake(readable_, readers_);
+            Wait(writable_, writers_, [this] { return Writable(); });
+            stalls++;
+        }
+        Wake(readable_, readers_);
+        return stalls;
+    }
+
+    /*! pop up to max events, blocks while empty and open
+     *  \return events popped, 0 once closed and empty */
+    size_t Pop(std::vector<SpEvent> &evts, size_t max)
+    {
+        for (;;) {
+            size_t n = TryPop(evts, max);
+            if (n == 0 && closed_.load()) {
+                n = TryPop(evts, max); // pushes before Close are visible now
+            }
+            if (n || closed_.load()) {
+                if (n) Wake(writable_, writers_);
+                return n;
+            }
+            Wait(readable_, readers_, [this] { return Readable() || closed_.load(); });
+        }
+    }
+
+    /*! no more pushes, readers return once the queue is empty */
+    void Close()
+    {
+        closed_.store(true);
+        Wake(readable_, readers_);
+    }
+
+  private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        SpEvent evt;
+    };
+
+    bool TryPush(SpEvent &evt)
+    {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.evt = std::move(evt);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t TryPop(std::vector<SpEvent> &evts, size_t max)
+    {
+        size_t n = 0;
+        size_t pos = head_.load(std::memory_order_relaxed);
+        while (n < max) {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    evts.push_back(std::move(cell.evt));
+                    cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    ++n;
+                    ++pos;
+                }
+            } else if (diff < 0) {
+                break; // empty
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        return n;
+    }
+
+    bool Readable() const
+    {
+        size_t pos = head_.load();
+        return cells_[pos & mask_].seq.load() == pos + 1;
+    }
+
+    bool Writable() const
+    {
+        size_t pos = tail_.load();
+        return cells_[pos & mask_].seq.load() == pos;
+    }
+
+    template <typename Pred>
+    void Wait(std::condition_variable &cond, std::atomic<int> &waiters, Pred ready)
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        waiters.fetch_add(1);
+        while (!ready()) {
+            cond.wait(l);
+        }
+        waiters.fetch_sub(1);
+    }
+
+    void Wake(std::condition_variable &cond, std::atomic<int> &waiters)
+    {
+        // pairs with the increment in Wait, a waiter either sees the
+        // change or is counted here
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed)) {
+            { std::lock_guard<std::mutex> l(mutex_); }
+            cond.notify_all();
+        }
+    }
+
+  private:
+    size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+    alignas(64) std::atomic<bool> closed_;
+    std::mutex mutex_;
+    std::condition_variable readable_;
+    std::condition_variable writable_;
+    std::atomic<int> readers_;
+    std::atomic<int> writers_;
+};
+
+/*! \brief A stage, its input queue and workers
+ */
+struct Pipeline::Stage {
+    Stage(const std::string &n, StageFn f, size_t w, size_t capacity)
+      : name(n), fn(std::move(f)), workers(w), input(capacity), threads()
+      , live(0), processed(0), filtered(0), stalls(0), busy(0) {}
+
+    std::string name;
+    StageFn fn;
+    size_t workers;
+    Queue input;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> live;   /*!< workers not finished, the last closes the next queue */
+    std::atomic<uint64_t> processed;
+    std::atomic<uint64_t> filtered;
+    std::atomic<uint64_t> stalls;
+    std::atomic<int64_t> busy;
+};
+
+Pipeline::Pipeline(size_t capacity, size_t batch)
+  : capacity_(capacity ? capacity : 1)
+  , batch_(batch ? batch : 1)
+  , stages_()
+  , running_(false)
+  , senders_(0)
+{
+}
+
+Pipeline::~Pipeline()
+{
+    Stop();
+}
+
+bool Pipeline::AddStage(const std::string &name, StageFn fn, size_t workers)
+{
+    if (!fn || workers == 0 || running_) {
+        return false;
+    }
+    stages_.emplace_back(new Stage(name, std::move(fn), workers, capacity_));
+    return true;
+}
+
+bool Pipeline::Start()
+{
+    if (stages_.empty() || running_ || stages_[0]->threads.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < stages_.size(); ++i) {
+        Stage &s = *stages_[i];
+        s.live = s.workers;
+        for (size_t w = 0; w < s.workers; ++w) {
+            s.threads.emplace_back(&Pipeline::Routine, this, i);
+        }
+    }
+    running_ = true;
+    return true;
+}
+
+bool Pipeline::Send(SpEvent evt)
+{
+    if (evt == nullptr) {
+        return false;
+    }
+    // Stop waits for the senders it did not turn away
+    senders_.fetch_add(1);
+    bool ok = running_.load();
+    if (ok) {
+        stages_[0]->input.Push(&evt, 1);
+    }
+    senders_.fetch_sub(1);
+    return ok;
+}
+
+void Pipeline::Stop()
+{
+    if (!running_.exchange(false)) {
+        return;
+    }
+    while (senders_.load()) {
+        std::this_thread::yield();
+    }
+    // stages close their successors as they run dry
+    stages_[0]->input.Close();
+    for (auto &s : stages_) {
+        for (auto &t : s->threads) {
+            t.join();
+        }
+    }
+}
+
+std::vector<StageStats> Pipeline::GetStats() const
+{
+    std::vector<StageStats> stats;
+    for (auto &s : stages_) {
+        StageStats st;
+        st.name = s->name;
+        st.workers = s->workers;
+        st.processed = s->processed.load(std::memory_order_relaxed);
+        st.filtered = s->filtered.load(std::memory_order_relaxed);
+        st.stalls = s->stalls.load(std::memory_order_relaxed);
+        st.busy = std::chrono::nanoseconds(s->busy.load(std::memory_order_relaxed));
+        st.occupancy = s->input.Size();
+        st.capacity = s->input.Capacity();
+        stats.push_back(st);
+    }
+    return stats;
+}
+
+void Pipeline::Routine(size_t i)
+{
+    Stage &s = *stages_[i];
+    Queue *next = i + 1 < stages_.size() ? &stages_[i + 1]->input : nullptr;
+    std::vector<SpEvent> in, out;
+    in.reserve(batch_);
+    out.reserve(batch_);
+
+    while (size_t n = s.input.Pop(in, batch_)) {
+        auto start = std::chrono::steady_clock::now();
+        for (auto &evt : in) {
+            SpEvent r = s.fn(std::move(evt));
+            if (r && next) {
+                out.push_back(std::move(r));
+            } else if (!r) {
+                s.filtered.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        s.busy.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+        s.processed.fetch_add(n, std::memory_order_relaxed);
+        in.clear();
+        if (!out.empty()) {
+            s.stalls.fetch_add(next->Push(out.data(), out.size()), std::memory_order_relaxed);
+            out.clear();
+        }
+    }
+
+    if (s.live.fetch_sub(1) == 1 && next) {
+        next->Close();
+    }
+}
+
+};
@@ -18,11 +18,23 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /*!< for thread_spawn */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "allocator.h"
+#include "evttrace.h"
+#include "probes.h"
 #include "event_hub.h"
 
 struct evtinfo_t {
@@ -30,84 +42,689 @@ struct evtinfo_t {
     event_t evt;
 };
 
-struct thread_ctrl_t {
-    unsigned char exit;
-    pthread_t tid;
+/*! Events are kept in one list per priority, a bitmap marks the non-empty
+ *  lists so the highest pending priority is found without walking events.
+ *  FIFO mode queues everything into the first bucket.
+ */
+#define EVTHUB_PRIORITIES   (256)
+#define EVTHUB_SHRINK_IDLE_NS   (100000000LL)  /*!< Idle time before a grown pool shrinks */
+#define EVTHUB_BUCKET(prio) (EVTHUB_PRIORITIES - 1 - (prio))
+
+struct evtqueue_t {
+    unsigned int count;                             /*!< Number of queued events */
+    unsigned int waiters;                           /*!< Workers sleeping on cond */
+    unsigned int workers;                           /*!< Workers serving this queue */
+    unsigned long long pushed;                      /*!< Events ever queued, for evthub_drain */
     pthread_cond_t cond;
     pthread_mutex_t mutex;
+    struct hbitmap bits;                            /*!< Non-empty buckets */
+    unsigned long long words[HBITS_TO_WORDS(EVTHUB_PRIORITIES) + 2];
+    struct listnode buckets[EVTHUB_PRIORITIES];
 };
 
+/*! Subscribers of one event identifier. A published list is never modified,
+ *  subscribe/unsubscribe publish a copy and retire the old list until the
+ *  dispatch thread has passed a quiescent point.
+ */
+#define EVTHUB_EVENT_IDS    (EVENT_ID_END + 1)
 
-ALLOCATOR_DECLARE(evthub, struct evtinfo_t);
-ALLOCATOR_IMPLEMENT(evthub, struct evtinfo_t);
+struct evtsub_t {
+    on_event_f cb;
+    void *user_data;
+};
+
+struct evtsubs_t {
+    struct evtsubs_t *retired;  /*!< Next list waiting to be reclaimed */
+    unsigned long long epoch;   /*!< Subscription epoch the list was retired in */
+    unsigned int count;
+    struct evtsub_t subs[1];
+};
+
+/*! A dispatch thread. Workers share one queue in unordered mode, in
+ *  EVENT_HUB_ORDER_ID mode every worker owns the queue its ids hash to.
+ */
+struct evtworker_t {
+    pthread_t tid;
+    struct evthub_handle_t *evthub;
+    struct evtqueue_t *queue;
+    unsigned long long seen_epoch;  /*!< sub_epoch seen by this worker */
+    event_t *batch;             /*!< Events handed to batch_notifier */
+    struct evtinfo_t **slots;   /*!< Pool elements of the events being dispatched */
+    unsigned int depth;         /*!< Events left queued when the batch was taken */
+};
+
+/*! Ring of event slots for EVENT_HUB_MODE_SPSC. The producer only writes
+ *  tail and the worker only writes head, each on its own cache line, so
+ *  neither side takes a lock. The worker parks on a futex when it finds the
+ *  ring empty, and the producer only enters the kernel to wake it then.
+ */
+#define EVTHUB_CACHELINE    (64)
+
+struct evtring_t {
+    unsigned int head;          /*!< Next slot to dispatch, written by the worker */
+    char pad0[EVTHUB_CACHELINE - sizeof(unsigned int)];
+    unsigned int tail;          /*!< Next slot to fill, written by the producer */
+    unsigned int parked;        /*!< Futex word, set while the worker sleeps */
+    char pad1[EVTHUB_CACHELINE - 2 * sizeof(unsigned int)];
+    unsigned int mask;          /*!< Slot count minus one, slot count is a power of 2 */
+    size_t stride;              /*!< Bytes per slot, event_t followed by payload */
+    char *slots;
+};
+
+/*! Send rate limit of one event id, GCRA: tat is the time the bucket is
+ *  theoretically empty again. A send moves it one interval ahead and is
+ *  over the limit when it would get further than span ahead of now.
+ *  interval 0 means no limit.
+ */
+struct evtlimit_t {
+    unsigned long long tat;         /*!< Theoretical arrival time in ns */
+    unsigned long long interval;    /*!< Nanoseconds per event */
+    unsigned long long span;        /*!< interval times burst */
+    evthub_limit_action action;
+};
+
+LF_ALLOCATOR_DECLARE(evthub, struct evtinfo_t);
+LF_ALLOCATOR_IMPLEMENT(evthub, struct evtinfo_t);
 
 struct evthub_handle_t {
-    struct listnode list;
-    struct thread_ctrl_t ctrl;  /*!< Control thread resource */
+    unsigned char exit;
+    unsigned char draining;     /*!< Set by evthub_drain, sends are rejected */
+    unsigned int nqueues;
+    unsigned int nworkers;
+    unsigned int running;       /*!< Workers started and not joined yet */
+    unsigned long long dispatched;  /*!< Events ever dispatched, for evthub_drain */
+    unsigned long long discarded;   /*!< Events taken by workers but dropped on exit */
+    struct evtqueue_t *queues;
+    struct evtworker_t *workers;
     evthub_mode mode;
     void *user_data;
     on_event_f notifier;
-    ALLOCATOR_DEFINE(evthub, pool);
+    on_events_f batch_notifier;
+    unsigned int chunk;         /*!< Capacity of the dispatch buffers */
+    unsigned int payload;       /*!< Inline payload bytes behind every event */
+    struct evtring_t *ring;     /*!< Event slots in EVENT_HUB_MODE_SPSC instead of pool and queue */
+    FILE *trace;                /*!< Accepted events are recorded here, see evthub_trace */
+    struct evtsubs_t *table[EVTHUB_EVENT_IDS];  /*!< Subscribers by event id */
+    struct evtlimit_t limits[EVTHUB_EVENT_IDS]; /*!< Send rate limits by event id */
+    struct evtsubs_t *retired;  /*!< Lists replaced in table, not yet reclaimed */
+    unsigned long long sub_epoch;   /*!< Bumped whenever lists are retired */
+    pthread_mutex_t sub_mutex;  /*!< Serializes subscribe and unsubscribe */
+    unsigned int space_waiters; /*!< Senders sleeping in evthub_send_timed */
+    pthread_cond_t space_cond;  /*!< Signaled when workers release events */
+    pthread_mutex_t space_mutex;
+    LF_ALLOCATOR_DEFINE(evthub, pool);
 };
 
-static void* thread_routine(evthub_t handle)
+static void queue_init(struct evtqueue_t *q, unsigned int workers)
+{
+    int i;
+    pthread_condattr_t attr;
+    q->count = 0;
+    q->pushed = 0;
+    q->waiters = 0;
+    q->workers = workers;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&q->mutex, NULL);
+    hbitmap_init(&q->bits, q->words, EVTHUB_PRIORITIES);
+    for (i = 0; i < EVTHUB_PRIORITIES; i++) {
+        list_init(&q->buckets[i]);
+    }
+}
+
+static void queue_push(struct evtqueue_t *q, evthub_mode mode, struct evtinfo_t *e)
+{
+    int b = mode == EVENT_HUB_MODE_FIFO ? 0 : EVTHUB_BUCKET(e->evt.priority);
+    list_add_tail(&q->buckets[b], &e->node);
+    hbitmap_set(&q->bits, b);
+    q->count++;
+    q->pushed++;
+}
+
+/*! Move up to limit queued events to the tail of list, in dispatch order */
+static void queue_take(struct evtqueue_t *q, struct listnode *list, unsigned int limit)
+{
+    int b;
+    struct listnode *bucket, *n;
+    if (limit < q->count) {
+        q->count -= limit;
+        while (limit--) {
+            b = hbitmap_ffs(&q->bits);
+            n = list_head(&q->buckets[b]);
+            list_remove(n);
+            list_add_tail(list, n);
+            if (list_empty(&q->buckets[b])) {
+                hbitmap_clear(&q->bits, b);
+            }
+        }
+        return;
+    }
+    /*! taking everything, splice whole buckets */
+    while ((b = hbitmap_ffs(&q->bits)) >= 0) {
+        bucket = &q->buckets[b];
+        list->prev->next = bucket->next;
+        bucket->next->prev = list->prev;
+        bucket->prev->next = list;
+        list->prev = bucket->prev;
+        list_init(bucket);
+        hbitmap_clear(&q->bits, b);
+    }
+    q->count = 0;
+}
+
+/*! Called by a worker whenever it holds no subscriber list */
+static void subs_quiesce(struct evtworker_t *w)
+{
+    unsigned long long epoch;
+    epoch = __atomic_load_n(&w->evthub->sub_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&w->seen_epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+/*! Called by a worker before it parks, it holds no subscriber list until
+ *  it quiesces again, so an idle hub never holds back subs_reclaim */
+static void subs_park(struct evtworker_t *w)
+{
+    __atomic_store_n(&w->seen_epoch, ~0ULL, __ATOMIC_SEQ_CST);
+}
+
+/*! Oldest sub_epoch still seen by a worker */
+static unsigned long long subs_seen(struct evthub_handle_t *evthub)
 {
+    unsigned int i;
+    unsigned long long epoch, seen = ~0ULL;
+    for (i = 0; i < evthub->nworkers; i++) {
+        epoch = __atomic_load_n(&evthub->workers[i].seen_epoch, __ATOMIC_SEQ_CST);
+        if (epoch < seen) {
+            seen = epoch;
+        }
+    }
+    return seen;
+}
+
+/*! Free retired lists no worker can see anymore, sub_mutex held */
+static void subs_reclaim(struct evthub_handle_t *evthub, unsigned long long seen)
+{
+    struct evtsubs_t **p = &evthub->retired, *l;
+    while ((l = *p) != NULL) {
+        if (l->epoch <= seen) {
+            *p = l->retired;
+            free(l);
+        } else {
+            p = &l->retired;
+        }
+    }
+}
+
+/*! Publish a copy of the list of id with cb added or removed, sub_mutex held */
+static int subs_update(struct evthub_handle_t *evthub, event_id id,
+                       on_event_f cb, void *user_data, int add)
+{
+    unsigned int i, n = 0;
+    struct evtsubs_t *old, *neu = NULL;
+    old = evthub->table[id];
+    if (old) {
+        for (i = 0; i < old->count; i++) {
+            if (old->subs[i].cb == cb && old->subs[i].user_data == user_data) {
+                break;
+            }
+        }
+        RETURN_IF_TRUE(add && i < old->count, UTILS_SUCC);
+        RETURN_IF_TRUE(!add && i == old->count, UTILS_ERR_PARAM);
+        n = old->count;
+    } else {
+        RETURN_IF_TRUE(!add, UTILS_ERR_PARAM);
+    }
+
+    n = add ? n + 1 : n - 1;
+    if (n) {
+        neu = (struct evtsubs_t*)malloc(sizeof(struct evtsubs_t)
+                                        + (n - 1) * sizeof(struct evtsub_t));
+        RETURN_IF_NULL(neu, UTILS_ERR_MALLOC);
+        neu->retired = NULL;
+        neu->epoch = 0;
+        neu->count = 0;
+        for (i = 0; old && i < old->count; i++) {
+            if (add || old->subs[i].cb != cb || old->subs[i].user_data != user_data) {
+                neu->subs[neu->count++] = old->subs[i];
+            }
+        }
+        if (add) {
+            neu->subs[neu->count].cb = cb;
+            neu->subs[neu->count].user_data = user_data;
+            neu->count++;
+        }
+    }
+    __atomic_store_n(&evthub->table[id], neu, __ATOMIC_RELEASE);
+    if (old) {
+        old->retired = evthub->retired;
+        evthub->retired = old;
+    }
+    return UTILS_SUCC;
+}
+
+static int subs_change(const evthub_t handle, event_id first, event_id last,
+                       on_event_f cb, void *user_data, int add)
+{
+    int s = UTILS_SUCC;
+    unsigned int id;
+    unsigned long long epoch;
+    struct evtsubs_t *l;
     struct evthub_handle_t *evthub = (struct evthub_handle_t*)handle;
-    RETURN_IF_NULL(evthub, NULL);
-    while (!evthub->ctrl.exit) {
-        pthread_mutex_lock(&evthub->ctrl.mutex);
-        if (list_empty(&evthub->list)) {
-            pthread_cond_wait(&evthub->ctrl.cond, &evthub->ctrl.mutex);
-            pthread_mutex_unlock(&evthub->ctrl.mutex);
+
+    RETURN_IF_NULL(evthub, UTILS_ERR_PTR);
+    RETURN_IF_NULL(cb, UTILS_ERR_PARAM);
+    RETURN_IF_TRUE(first > last, UTILS_ERR_PARAM);
+
+    pthread_mutex_lock(&evthub->sub_mutex);
+    for (id = first; id <= last && s == UTILS_SUCC; id++) {
+        s = subs_update(evthub, (event_id)id, cb, user_data, add);
+    }
+    /*! stamp the lists retired by this call after they were unpublished */
+    epoch = __atomic_add_fetch(&evthub->sub_epoch, 1, __ATOMIC_SEQ_CST);
+    for (l = evthub->retired; l && !l->epoch; l = l->retired) {
+        l->epoch = epoch;
+    }
+    subs_reclaim(evthub, subs_seen(evthub));
+    pthread_mutex_unlock(&evthub->sub_mutex);
+    return s;
+}
+
+/*! Notify user of the n events in w->batch */
+static void dispatch_batch(struct evtworker_t *w, unsigned int n)
+{
+    unsigned int i, j;
+    struct evtsubs_t *subs;
+    struct evthub_handle_t *evthub = w->evthub;
+    for (i = 0; i < n; i++) {
+        const event_t *evt = &w->batch[i];
+        EVTHUB_PROBE(evthub, dequeue, evt->id, evt->priority, w->depth);
+        if (evthub->notifier) {
+            EVTHUB_PROBE(evthub, handler_entry, evt->id, evt->priority, evthub->notifier);
+            evthub->notifier(evt, evthub->user_data);
+            EVTHUB_PROBE(evthub, handler_exit, evt->id, evt->priority, evthub->notifier);
+        }
+        /*! jump to the subscribers of this id, no lock needed */
+        subs = __atomic_load_n(&evthub->table[evt->id], __ATOMIC_ACQUIRE);
+        for (j = 0; subs && j < subs->count; j++) {
+            EVTHUB_PROBE(evthub, handler_entry, evt->id, evt->priority, subs->subs[j].cb);
+            subs->subs[j].cb(evt, subs->subs[j].user_data);
+            EVTHUB_PROBE(evthub, handler_exit, evt->id, evt->priority, subs->subs[j].cb);
+        }
+    }
+    if (evthub->batch_notifier) {
+        evthub->batch_notifier(w->batch, n, evthub->user_data);
+    }
+}
+
+/*! Wake senders waiting for room, only costs a fence when nobody waits */
+static void space_signal(struct evthub_handle_t *evthub)
+{
+    /*! order the release before reading waiters, pairs with evthub_send_timed */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&evthub->space_waiters, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&evthub->space_mutex);
+        pthread_cond_broadcast(&evthub->space_cond);
+        pthread_mutex_unlock(&evthub->space_mutex);
+    }
+}
+
+/*! Account a dispatched batch, then wake senders and drain waiting for it */
+static void dispatch_done(struct evthub_handle_t *evthub, unsigned int n)
+{
+    __atomic_add_fetch(&evthub->dispatched, n, __ATOMIC_RELEASE);
+    space_signal(evthub);
+}
+
+static void dispatch_list(struct evtworker_t *w, struct listnode *list)
+{
+    unsigned int n = 0;
+    struct listnode *node, *next;
+    struct evtinfo_t *e;
+    int stop = false;
+    list_for_each_safe(node, next, list) {
+        e = list_entry(node, struct evtinfo_t, node);
+        w->slots[n] = e;
+        w->batch[n] = e->evt;
+        if (++n == w->evthub->chunk || next == list) {
+            if (stop) {
+                LF_ALLOCATOR_FREE_BULK(evthub, &w->evthub->pool, w->slots, n);
+                __atomic_add_fetch(&w->evthub->discarded, n, __ATOMIC_RELAXED);
+            } else {
+                dispatch_batch(w, n);
+                /*! Release events to pool */
+                LF_ALLOCATOR_FREE_BULK(evthub, &w->evthub->pool, w->slots, n);
+                dispatch_done(w->evthub, n);
+                /*! Give up the rest of a long list once stopped */
+                stop = __atomic_load_n(&w->evthub->exit, __ATOMIC_ACQUIRE);
+            }
+            n = 0;
+        }
+    }
+}
+
+static void futex_wait(unsigned int *addr, unsigned int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static int ring_create(struct evtring_t **ring, unsigned int max, unsigned int payload)
+{
+    void *mem;
+    unsigned int size = 1;
+    struct evtring_t *r;
+    RETURN_IF_TRUE(max > (1u << 31), UTILS_ERR_POOL_SIZE);
+    while (size < max) {
+        size <<= 1;
+    }
+    RETURN_IF_FAIL(posix_memalign(&mem, EVTHUB_CACHELINE, sizeof(struct evtring_t)),
+                   UTILS_ERR_POOL_MEM);
+    r = (struct evtring_t*)mem;
+    memset(r, 0, sizeof(struct evtring_t));
+    r->mask = size - 1;
+    r->stride = (sizeof(event_t) + payload + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    r->slots = (char*)malloc(r->stride * size);
+    if (r->slots == NULL) {
+        free(r);
+        return UTILS_ERR_POOL_MEM;
+    }
+    *ring = r;
+    return UTILS_SUCC;
+}
+
+static void ring_destory(struct evtring_t *r)
+{
+    if (r) {
+        free(r->slots);
+        free(r);
+    }
+}
+
+static void ring_wake(struct evtring_t *r)
+{
+    /*! order the tail store before reading parked, pairs with the worker */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->parked, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&r->parked, 0, __ATOMIC_RELAXED);
+        futex_wake(&r->parked);
+    }
+}
+
+/*! Producer side: the free slot to fill, NULL if the ring is full */
+static event_t* ring_reserve(struct evtring_t *r)
+{
+    unsigned int tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask) {
+        return NULL;
+    }
+    return (event_t*)(r->slots + (size_t)(tail & r->mask) * r->stride);
+}
+
+static void ring_commit(struct evtring_t *r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+#ifndef TEST_ON
+    ring_wake(r);
+#endif
+}
+
+static void* ring_routine(void *arg)
+{
+    unsigned int head, tail, n;
+    struct evtworker_t *w = (struct evtworker_t*)arg;
+    struct evthub_handle_t *evthub = w->evthub;
+    struct evtring_t *r = evthub->ring;
+    while (!__atomic_load_n(&evthub->exit, __ATOMIC_ACQUIRE)) {
+        head = r->head;
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            subs_park(w);
+            __atomic_store_n(&r->parked, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head
+                && !__atomic_load_n(&evthub->exit, __ATOMIC_SEQ_CST)) {
+                EVTHUB_PROBE(evthub, park, 0, 0, 0);
+                futex_wait(&r->parked, 1);
+                EVTHUB_PROBE(evthub, unpark, 0, 0, r->tail - head);
+            }
+            __atomic_store_n(&r->parked, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        /*! copy out a batch, slots stay valid until head moves past them */
+        subs_quiesce(w);
+        for (n = 0; head != tail && n < evthub->chunk; head++, n++) {
+            w->batch[n] = *(event_t*)(r->slots + (size_t)(head & r->mask) * r->stride);
+        }
+        w->depth = tail - head;
+        dispatch_batch(w, n);
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+        dispatch_done(evthub, n);
+    }
+    return NULL;
+}
+
+static void* thread_routine(void *arg)
+{
+    unsigned int limit;
+    int busy = false, idle;
+    struct timespec deadline;
+    struct evtworker_t *w = (struct evtworker_t*)arg;
+    struct evthub_handle_t *evthub = w->evthub;
+    struct evtqueue_t *q = w->queue;
+    while (!__atomic_load_n(&evthub->exit, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&q->mutex);
+        if (!q->count) {
+            pthread_mutex_unlock(&q->mutex);
+            subs_park(w);
+            /*! Return surplus slabs of a grown pool only once it stayed idle
+             *  for EVTHUB_SHRINK_IDLE_NS, so bursts do not pay for a shrink */
+            idle = busy && __atomic_load_n(&evthub->pool.slabs, __ATOMIC_RELAXED) > 1;
+            if (idle) {
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += (deadline.tv_nsec + EVTHUB_SHRINK_IDLE_NS) / 1000000000LL;
+                deadline.tv_nsec = (deadline.tv_nsec + EVTHUB_SHRINK_IDLE_NS) % 1000000000LL;
+            }
+            pthread_mutex_lock(&q->mutex);
+            if (!q->count && !evthub->exit) {
+                q->waiters++;
+                EVTHUB_PROBE(evthub, park, w - evthub->workers, 0, 0);
+                if (!idle) {
+                    pthread_cond_wait(&q->cond, &q->mutex);
+                } else if (pthread_cond_timedwait(&q->cond, &q->mutex, &deadline) != ETIMEDOUT
+                           || q->count) {
+                    idle = false;
+                }
+                EVTHUB_PROBE(evthub, unpark, w - evthub->workers, 0, q->count);
+                q->waiters--;
+            } else {
+                idle = false;
+            }
+            pthread_mutex_unlock(&q->mutex);
+            if (idle) {
+                LF_ALLOCATOR_SHRINK(evthub, &evthub->pool);
+                busy = false;
+            }
         } else {
-            struct listnode *n;
-            struct evtinfo_t *e;
-            /*! fetch event in the front of list */
-            n = list_head(&evthub->list);
-            list_remove(n);
-            pthread_mutex_unlock(&evthub->ctrl.mutex);
+            list_declare(pending);
+            /*! fetch pending events under one lock, workers sharing the
+             *  queue take an even share and pass the rest to a sleeper */
+            limit = (q->count + q->workers - 1) / q->workers;
+            queue_take(q, &pending, limit);
+            w->depth = q->count;
+            if (q->count && q->waiters) {
+                pthread_cond_signal(&q->cond);
+            }
+            pthread_mutex_unlock(&q->mutex);
 
-            /*! restore event info and notify user */
-            e = list_entry(n, struct evtinfo_t, node);
-            evthub->notifier(&e->evt, evthub->user_data);
-            /*! Release event to pool */
-            ALLOCATOR_FREE(evthub, &evthub->pool, e);
+            /*! notify user and release events to pool in bulk */
+            subs_quiesce(w);
+            dispatch_list(w, &pending);
+            busy = true;
         }
     }
 
     return NULL;
 }
 
+/*! Wake every worker, sleeping ones recheck their queue and exit */
+static void evthub_wake_all(struct evthub_handle_t *evthub)
+{
+    unsigned int i;
+    if (evthub->ring) {
+        ring_wake(evthub->ring);
+    }
+    for (i = 0; evthub->queues && i < evthub->nqueues; i++) {
+        pthread_mutex_lock(&evthub->queues[i].mutex);
+        pthread_cond_broadcast(&evthub->queues[i].cond);
+        pthread_mutex_unlock(&evthub->queues[i].mutex);
+    }
+}
+
+/*! Stop the workers that are running */
+static void evthub_stop(struct evthub_handle_t *evthub)
+{
+    unsigned int i;
+    /*! Notify threads to exit */
+    __atomic_store_n(&evthub->exit, true, __ATOMIC_SEQ_CST);
+    evthub_wake_all(evthub);
+    /*! Waiting untill threads are exited */
+    for (i = 0; i < evthub->running; i++) {
+        pthread_join(evthub->workers[i].tid, NULL);
+    }
+    evthub->running = 0;
+}
+
+/*! Stop the workers that are running and release everything of evthub */
+static void evthub_release(struct evthub_handle_t *evthub)
+{
+    unsigned int i;
+    evthub_stop(evthub);
+    /*! Waiting untill blocked senders have seen exit and left */
+    pthread_mutex_lock(&evthub->space_mutex);
+    pthread_cond_broadcast(&evthub->space_cond);
+    pthread_mutex_unlock(&evthub->space_mutex);
+    while (__atomic_load_n(&evthub->space_waiters, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    pthread_mutex_lock(&evthub->space_mutex);
+    pthread_mutex_unlock(&evthub->space_mutex);
+
+    for (i = 0; evthub->workers && i < evthub->nworkers; i++) {
+        free(evthub->workers[i].batch);
+        free(evthub->workers[i].slots);
+    }
+    for (i = 0; evthub->queues && i < evthub->nqueues; i++) {
+        pthread_mutex_destroy(&evthub->queues[i].mutex);
+        pthread_cond_destroy(&evthub->queues[i].cond);
+    }
+    for (i = 0; i < EVTHUB_EVENT_IDS; i++) {
+        free(evthub->table[i]);
+    }
+    subs_reclaim(evthub, evthub->sub_epoch);
+    pthread_mutex_destroy(&evthub->sub_mutex);
+    pthread_mutex_destroy(&evthub->space_mutex);
+    pthread_cond_destroy(&evthub->space_cond);
+    LF_ALLOCATOR_DESTORY(evthub, &evthub->pool);
+    ring_destory(evthub->ring);
+    if (evthub->trace) {
+        fclose(evthub->trace);
+    }
+    free(evthub->workers);
+    free(evthub->queues);
+    free(evthub);
+}
+
 int evthub_create(evthub_t *handle, evthub_parm *param)
 {
     int s;
-    unsigned int size;
+    unsigned int i, size;
     struct evthub_handle_t *evthub;
+    struct evtworker_t *w;
+    pthread_condattr_t attr;
 
     /*! Parameter check */
     RETURN_IF_NULL(handle, UTILS_ERR_PTR);
     RETURN_IF_NULL(param, UTILS_ERR_PTR);
-    RETURN_IF_NULL(param->notifier, UTILS_ERR_PARAM);
     RETURN_IF_TRUE(param->max < 1, UTILS_ERR_PARAM);
+    RETURN_IF_TRUE(param->ceiling && param->ceiling < param->max, UTILS_ERR_PARAM);
 
     size = sizeof(struct evthub_handle_t);
-    evthub = (struct evthub_handle_t*)malloc(size);
+    evthub = (struct evthub_handle_t*)calloc(1, size);
     RETURN_IF_NULL(evthub, UTILS_ERR_MALLOC);
-    *handle = (evthub_t)evthub;
+    *handle = NULL;
 
     /*! Initialize eventhub */
-    list_init(&evthub->list);
+    evthub->mode = param->mode;
     evthub->user_data = param->user_data;
     evthub->notifier = param->notifier;
-    evthub->ctrl.exit = false;
-    s = ALLOCATOR_CREATE(evthub, &evthub->pool, param->max);
-    RETURN_IF_FAIL(s, s);
+    evthub->batch_notifier = param->batch_notifier;
+    evthub->exit = false;
+    evthub->chunk = param->max;
+    evthub->payload = param->payload;
+    evthub->nworkers = param->workers > 1 ? param->workers : 1;
+    evthub->nqueues = param->order == EVENT_HUB_ORDER_ID ? evthub->nworkers : 1;
+    pthread_mutex_init(&evthub->sub_mutex, NULL);
+    pthread_mutex_init(&evthub->space_mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&evthub->space_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (param->mode == EVENT_HUB_MODE_SPSC) {
+        /*! one consumer, events live in the ring */
+        evthub->nworkers = evthub->nqueues = 1;
+        s = ring_create(&evthub->ring, param->max, param->payload);
+    } else {
+        s = LF_ALLOCATOR_CREATE_EXTRA(evthub, &evthub->pool, param->max,
+                                      param->ceiling, param->payload);
+    }
+    if (s != UTILS_SUCC) {
+        pthread_mutex_destroy(&evthub->sub_mutex);
+        pthread_mutex_destroy(&evthub->space_mutex);
+        pthread_cond_destroy(&evthub->space_cond);
+        free(evthub);
+        return s;
+    }
 
-    pthread_cond_init(&evthub->ctrl.cond, NULL);
-    pthread_mutex_init(&evthub->ctrl.mutex, NULL);
+    evthub->queues = (struct evtqueue_t*)calloc(evthub->nqueues, sizeof(struct evtqueue_t));
+    evthub->workers = (struct evtworker_t*)calloc(evthub->nworkers, sizeof(struct evtworker_t));
+    if (!evthub->queues || !evthub->workers) {
+        evthub->nqueues = 0;
+        evthub_release(evthub);
+        return UTILS_ERR_MALLOC;
+    }
+    for (i = 0; i < evthub->nqueues; i++) {
+        queue_init(&evthub->queues[i], evthub->nworkers / evthub->nqueues);
+    }
+    for (i = 0; i < evthub->nworkers; i++) {
+        w = &evthub->workers[i];
+        w->evthub = evthub;
+        w->queue = &evthub->queues[i % evthub->nqueues];
+        w->batch = (event_t*)malloc(sizeof(event_t) * param->max);
+        w->slots = (struct evtinfo_t**)malloc(sizeof(struct evtinfo_t*) * param->max);
+        if (!w->batch || !w->slots) {
+            evthub_release(evthub);
+            return UTILS_ERR_MALLOC;
+        }
+    }
 
-    s = pthread_create(&evthub->ctrl.tid, NULL, &thread_routine, *handle);
-    RETURN_IF_FAIL(s, UTILS_ERR_THREAD);
+    for (i = 0; i < evthub->nworkers; i++) {
+        s = thread_spawn(&evthub->workers[i].tid, param->thread,
+                         evthub->nworkers > 1 ? (int)i : -1,
+                         evthub->ring ? &ring_routine : &thread_routine,
+                         &evthub->workers[i]);
+        if (s != UTILS_SUCC) {
+            evthub_release(evthub);
+            return s;
+        }
+        evthub->running++;
+    }
+    *handle = (evthub_t)evthub;
     return UTILS_SUCC;
 }
 
@@ -116,63 +733,486 @@ int evthub_destory(evthub_t *handle)
     RETURN_IF_NULL(handle, UTILS_ERR_PTR);
     struct evthub_handle_t *evthub = (struct evthub_handle_t*)(*handle);
     RETURN_IF_NULL(evthub, UTILS_ERR_PTR);
-    /*! Notify thread to exit  */
-    pthread_mutex_lock(&evthub->ctrl.mutex);
-    evthub->ctrl.exit = true;
-    pthread_cond_broadcast(&evthub->ctrl.cond);
-    pthread_mutex_unlock(&evthub->ctrl.mutex);
-
-    /*! Waiting untill thread is exited */
-    pthread_join(evthub->ctrl.tid, NULL);
-
-    ALLOCATOR_DESTORY(evthub, &evthub->pool);
-    pthread_mutex_destroy(&evthub->ctrl.mutex);
-    pthread_cond_destroy(&evthub->ctrl.cond);
-    free(*handle);
+    evthub_release(evthub);
     *handle = NULL;
     return UTILS_SUCC;
 }
 
-int evthub_send(const evthub_t handle, const event_t *evt)
+/*! Whether every event accepted so far has been dispatched */
+static int evthub_drained(struct evthub_handle_t *evthub)
 {
-    struct evtinfo_t *e;
+    unsigned int i;
+    unsigned long long pushed = 0;
+    if (evthub->ring) {
+        return __atomic_load_n(&evthub->ring->head, __ATOMIC_ACQUIRE)
+            == __atomic_load_n(&evthub->ring->tail, __ATOMIC_ACQUIRE);
+    }
+    for (i = 0; i < evthub->nqueues; i++) {
+        pthread_mutex_lock(&evthub->queues[i].mutex);
+        pushed += evthub->queues[i].pushed;
+        pthread_mutex_unlock(&evthub->queues[i].mutex);
+    }
+    return pushed == __atomic_load_n(&evthub->dispatched, __ATOMIC_ACQUIRE);
+}
+
+int evthub_drain(const evthub_t handle, long long timeout_ns,
+                 unsigned long long *dispatched, unsigned long long *dropped)
+{
+    int s = UTILS_SUCC;
+    unsigned int i;
+    unsigned long long start, left = 0;
+    struct timespec deadline;
     struct evthub_handle_t *evthub;
 
-    RETURN_IF_NULL(evt, UTILS_ERR_PTR);
     RETURN_IF_NULL(handle, UTILS_ERR_PTR);
     evthub = (struct evthub_handle_t*)handle;
+    RETURN_IF_TRUE(evthub->draining, UTILS_ERR_HUB_CLOSED);
 
-    /*! Allocate event information */
-    e = ALLOCATOR_ALLOC(evthub, &evthub->pool);
-    RETURN_IF_NULL(e, UTILS_ERR_POOL_ALLOC);
-    list_init(&e->node);
+    /*! Reject new sends, a sender past the check either queued already
+     *  or sees the flag under the queue lock */
+    __atomic_store_n(&evthub->draining, true, __ATOMIC_SEQ_CST);
+    for (i = 0; i < evthub->nqueues; i++) {
+        pthread_mutex_lock(&evthub->queues[i].mutex);
+        pthread_mutex_unlock(&evthub->queues[i].mutex);
+    }
+    start = __atomic_load_n(&evthub->dispatched, __ATOMIC_ACQUIRE);
+    if (timeout_ns > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ns / 1000000000LL;
+        deadline.tv_nsec += timeout_ns % 1000000000LL;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
 
-    /*! Insert event to list */
-    memcpy(&e->evt, evt, sizeof(event_t));
-    pthread_mutex_lock(&evthub->ctrl.mutex);
-    if (evthub->mode == EVENT_HUB_MODE_FIFO) {
-        list_add_tail(&evthub->list, &e->node);
-    } else {
-        struct listnode *node, *n;
-        struct evtinfo_t *entry;
-        list_for_each_safe(node, n, &evthub->list) {
-            entry = list_entry(node, struct evtinfo_t, node);
-            if (e->evt.priority > entry->evt.priority) {
-                /*! insert new node to ahead of current node */
-                list_add_tail(node, &e->node);
-                break;
-            }
+    /*! Wait as a space waiter, workers signal after every batch */
+    pthread_mutex_lock(&evthub->space_mutex);
+    __atomic_add_fetch(&evthub->space_waiters, 1, __ATOMIC_SEQ_CST);
+    evthub_wake_all(evthub);
+    while (!evthub_drained(evthub)) {
+        if (timeout_ns == 0) {
+            s = UTILS_ERR_TIMEOUT;
+        } else if (timeout_ns < 0) {
+            pthread_cond_wait(&evthub->space_cond, &evthub->space_mutex);
+        } else if (pthread_cond_timedwait(&evthub->space_cond, &evthub->space_mutex,
+                                          &deadline) == ETIMEDOUT) {
+            s = evthub_drained(evthub) ? UTILS_SUCC : UTILS_ERR_TIMEOUT;
         }
-        if (node == &evthub->list) {
-            list_add_tail(&evthub->list, &e->node);
+        if (s != UTILS_SUCC) {
+            break;
         }
     }
+    __atomic_sub_fetch(&evthub->space_waiters, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&evthub->space_mutex);
+
+    /*! Workers finish the batch in hand, what is still queued is dropped */
+    evthub_stop(evthub);
+    left = evthub->discarded;
+    if (evthub->ring) {
+        left += evthub->ring->tail - evthub->ring->head;
+    }
+    for (i = 0; i < evthub->nqueues; i++) {
+        left += evthub->queues[i].count;
+    }
+    if (dispatched) {
+        *dispatched = evthub->dispatched - start;
+    }
+    if (dropped) {
+        *dropped = left;
+    }
+    return left ? UTILS_ERR_TIMEOUT : UTILS_SUCC;
+}
+
+/*! Queue an event allocated from the pool and wake a worker */
+static int evthub_enqueue(struct evthub_handle_t *evthub, struct evtinfo_t *e)
+{
+    struct evtqueue_t *q;
+    list_init(&e->node);
 
-    /*! Notify thread to process event */
+    /*! Insert event to the queue its id is pinned to */
+    q = &evthub->queues[evthub->nqueues > 1 ? e->evt.id % evthub->nqueues : 0];
+    pthread_mutex_lock(&q->mutex);
+    if (__atomic_load_n(&evthub->draining, __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&q->mutex);
+        EVTHUB_PROBE(evthub, reject, e->evt.id, e->evt.priority, EVTHUB_REJECT_CLOSED);
+        LF_ALLOCATOR_FREE(evthub, &evthub->pool, e);
+        return UTILS_ERR_HUB_CLOSED;
+    }
+    queue_push(q, evthub->mode, e);
+    EVTHUB_PROBE(evthub, enqueue, e->evt.id, e->evt.priority, q->count);
+
+    /*! Wake one sleeping worker to process event */
 #ifndef TEST_ON
-    pthread_cond_broadcast(&evthub->ctrl.cond);
+    if (q->waiters) {
+        pthread_cond_signal(&q->cond);
+    }
 #endif
-    pthread_mutex_unlock(&evthub->ctrl.mutex);
+    pthread_mutex_unlock(&q->mutex);
+    return UTILS_SUCC;
+}
+
+static inline unsigned long long limit_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*! Take a token for id, one load when there is no limit and one CAS
+ *  otherwise, no lock. \return true if the event is within its limit */
+static int limit_admit(struct evthub_handle_t *evthub, event_id id)
+{
+    struct evtlimit_t *l = &evthub->limits[id];
+    unsigned long long now, tat, next;
+    unsigned long long interval = __atomic_load_n(&l->interval, __ATOMIC_ACQUIRE);
+    if (interval == 0) {
+        return true;
+    }
+    now = limit_now();
+    tat = __atomic_load_n(&l->tat, __ATOMIC_RELAXED);
+    do {
+        next = (tat > now ? tat : now) + interval;
+        if (next - now > __atomic_load_n(&l->span, __ATOMIC_RELAXED)) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&l->tat, &tat, next, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+/*! Overwrite a queued event of the same id and priority with evt, or with
+ *  the len bytes at buf kept inline when evt is NULL.
+ *  \return true if one was found */
+static int evthub_conflate(struct evthub_handle_t *evthub, event_id id, unsigned char priority,
+                           const event_t *evt, const void *buf, size_t len)
+{
+    int found = false;
+    struct listnode *n;
+    struct evtinfo_t *e;
+    struct evtqueue_t *q;
+    int b = evthub->mode == EVENT_HUB_MODE_FIFO ? 0 : EVTHUB_BUCKET(priority);
+
+    q = &evthub->queues[evthub->nqueues > 1 ? id % evthub->nqueues : 0];
+    pthread_mutex_lock(&q->mutex);
+    list_for_each(n, &q->buckets[b]) {
+        e = node_to_item(n, struct evtinfo_t, node);
+        if (e->evt.id != id || e->evt.priority != priority) {
+            continue;
+        }
+        if (evt) {
+            memcpy(&e->evt, evt, sizeof(event_t));
+            e->evt.size = 0;
+        } else {
+            e->evt.param = LF_ALLOCATOR_EXTRA(evthub, e);
+            e->evt.size = (unsigned int)len;
+            if (len) {
+                memcpy(e->evt.param, buf, len);
+            }
+        }
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return found;
+}
+
+/*! Reject probe reason of a send error */
+#define EVTHUB_REJECT_REASON(code)                                      \
+    ((code) == UTILS_ERR_HUB_CLOSED ? EVTHUB_REJECT_CLOSED :            \
+     (code) == UTILS_ERR_RATE_LIMITED ? EVTHUB_REJECT_LIMITED : EVTHUB_REJECT_FULL)
+
+/*! Fail a send with code, firing the reject probe */
+#define REJECT_IF_TRUE(cond, id, priority, code)                \
+    do {                                                        \
+        if (cond) {                                             \
+            EVTHUB_PROBE(evthub, reject, id, priority,          \
+                         EVTHUB_REJECT_REASON(code));           \
+            return code;                                        \
+        }                                                       \
+    } while (0)
+
+/*! Events in the ring, for probes */
+#define RING_DEPTH(r)   ((r)->tail - __atomic_load_n(&(r)->head, __ATOMIC_RELAXED))
+
+/*! Record an accepted event when tracing, one load and branch otherwise */
+static inline void evthub_capture(struct evthub_handle_t *evthub, event_id id,
+                                  unsigned char priority, size_t size)
+{
+    FILE *f = __atomic_load_n(&evthub->trace, __ATOMIC_ACQUIRE);
+    if (f) {
+        evttrace_write(f, id, priority, (uint32_t)size);
+    }
+}
+
+int evthub_trace(const evthub_t handle, const char *path)
+{
+    FILE *f = NULL;
+    struct evthub_handle_t *evthub;
+
+    RETURN_IF_NULL(handle, UTILS_ERR_PTR);
+    evthub = (struct evthub_handle_t*)handle;
+    if (path) {
+        f = evttrace_open(path);
+        RETURN_IF_NULL(f, UTILS_ERR_PARAM);
+    }
+    f = __atomic_exchange_n(&evthub->trace, f, __ATOMIC_ACQ_REL);
+    if (f) {
+        fclose(f);
+    }
+    return UTILS_SUCC;
+}
+
+/*! Apply the limit of id to a send.
+ *  \return UTILS_SUCC to go on queuing the event, 1 if it was dropped or
+ *          conflated, else error code */
+static int evthub_limited(struct evthub_handle_t *evthub, event_id id, unsigned char priority,
+                          const event_t *evt, const void *buf, size_t len)
+{
+    if (limit_admit(evthub, id)) {
+        return UTILS_SUCC;
+    }
+    switch (__atomic_load_n(&evthub->limits[id].action, __ATOMIC_RELAXED)) {
+    case EVENT_HUB_LIMIT_REJECT:
+        REJECT_IF_TRUE(true, id, priority, UTILS_ERR_RATE_LIMITED);
+        break;
+    case EVENT_HUB_LIMIT_CONFLATE:
+        if (evthub->ring) {
+            break; /*! the ring is not searched, drop it */
+        }
+        /*! nothing pending to overwrite, queue it */
+        if (!evthub_conflate(evthub, id, priority, evt, buf, len)) {
+            return UTILS_SUCC;
+        }
+        /*! accepted in place of the pending one, replays see it too */
+        evthub_capture(evthub, id, priority, evt ? 0 : len);
+        break;
+    default:
+        break;
+    }
+    EVTHUB_PROBE(evthub, reject, id, priority, EVTHUB_REJECT_LIMITED);
+    return 1;
+}
+
+int evthub_limit(const evthub_t handle, event_id first, event_id last,
+                 unsigned int rate, unsigned int burst, evthub_limit_action action)
+{
+    unsigned int i;
+    unsigned long long interval;
+    struct evtlimit_t *l;
+    struct evthub_handle_t *evthub;
+
+    RETURN_IF_NULL(handle, UTILS_ERR_PTR);
+    RETURN_IF_TRUE(first > last, UTILS_ERR_PARAM);
+    RETURN_IF_TRUE(rate && burst == 0, UTILS_ERR_PARAM);
+    RETURN_IF_TRUE(action > EVENT_HUB_LIMIT_CONFLATE, UTILS_ERR_PARAM);
+    evthub = (struct evthub_handle_t*)handle;
+
+    interval = rate ? 1000000000ULL / rate : 0;
+    if (rate && interval == 0) {
+        interval = 1;
+    }
+    for (i = first; i <= last; i++) {
+        l = &evthub->limits[i];
+        /*! publish interval last, it enables the limit */
+        __atomic_store_n(&l->interval, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&l->action, action, __ATOMIC_RELAXED);
+        __atomic_store_n(&l->span, interval * burst, __ATOMIC_RELAXED);
+        __atomic_store_n(&l->tat, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&l->interval, interval, __ATOMIC_RELEASE);
+    }
     return UTILS_SUCC;
 }
 
+/*! Queue evt without checking its limit */
+static int evthub_post(struct evthub_handle_t *evthub, const event_t *evt)
+{
+    int s;
+    struct evtinfo_t *e;
+
+    if (evthub->ring) {
+        event_t *slot = ring_reserve(evthub->ring);
+        REJECT_IF_TRUE(slot == NULL, evt->id, evt->priority, UTILS_ERR_POOL_FULL);
+        memcpy(slot, evt, sizeof(event_t));
+        slot->size = 0; /*! nothing is stored inline */
+        evthub_capture(evthub, evt->id, evt->priority, 0);
+        ring_commit(evthub->ring);
+        EVTHUB_PROBE(evthub, enqueue, evt->id, evt->priority, RING_DEPTH(evthub->ring));
+        return UTILS_SUCC;
+    }
+
+    /*! Allocate event information */
+    e = LF_ALLOCATOR_ALLOC(evthub, &evthub->pool);
+    REJECT_IF_TRUE(e == NULL, evt->id, evt->priority, UTILS_ERR_POOL_ALLOC);
+    memcpy(&e->evt, evt, sizeof(event_t));
+    e->evt.size = 0; /*! nothing is stored inline */
+    s = evthub_enqueue(evthub, e);
+    if (s == UTILS_SUCC) {
+        evthub_capture(evthub, evt->id, evt->priority, 0);
+    }
+    return s;
+}
+
+int evthub_send(const evthub_t handle, const event_t *evt)
+{
+    int s;
+    struct evthub_handle_t *evthub;
+
+    RETURN_IF_NULL(evt, UTILS_ERR_PTR);
+    RETURN_IF_NULL(handle, UTILS_ERR_PTR);
+    evthub = (struct evthub_handle_t*)handle;
+    REJECT_IF_TRUE(__atomic_load_n(&evthub->draining, __ATOMIC_RELAXED),
+                   evt->id, evt->priority, UTILS_ERR_HUB_CLOSED);
+    s = evthub_limited(evthub, evt->id, evt->priority, evt, NULL, 0);
+    if (s != UTILS_SUCC) {
+        return s > 0 ? UTILS_SUCC : s;
+    }
+    return evthub_post(evthub, evt);
+}
+
+/*! Queue a copy of len bytes at buf without checking the limit */
+static int evthub_post_data(struct evthub_handle_t *evthub, event_id id, unsigned char priority,
+                            const void *buf, size_t len)
+{
+    int s;
+    event_t *evt;
+    struct evtinfo_t *e = NULL;
+
+    /*! Allocate event information, data is copied behind it */
+    if (evthub->ring) {
+        evt = ring_reserve(evthub->ring);
+        REJECT_IF_TRUE(evt == NULL, id, priority, UTILS_ERR_POOL_FULL);
+        evt->param = evt + 1;
+    } else {
+        e = LF_ALLOCATOR_ALLOC(evthub, &evthub->pool);
+        REJECT_IF_TRUE(e == NULL, id, priority, UTILS_ERR_POOL_ALLOC);
+        evt = &e->evt;
+        evt->param = LF_ALLOCATOR_EXTRA(evthub, e);
+    }
+    evt->id = id;
+    evt->priority = priority;
+    evt->size = (unsigned int)len;
+    if (len) {
+        memcpy(evt->param, buf, len);
+    }
+    if (evthub->ring) {
+        evthub_capture(evthub, id, priority, len);
+        ring_commit(evthub->ring);
+        EVTHUB_PROBE(evthub, enqueue, id, priority, RING_DEPTH(evthub->ring));
+        return UTILS_SUCC;
+    }
+    s = evthub_enqueue(evthub, e);
+    if (s == UTILS_SUCC) {
+        evthub_capture(evthub, id, priority, len);
+    }
+    return s;
+}
+
+/*! Retry a post refused for room until a worker releases some, evt is
+ *  queued as is, or when data is set its param and size are copied */
+static int evthub_post_wait(struct evthub_handle_t *evthub, const event_t *evt,
+                            int data, long long timeout_ns)
+{
+    int s, expired = false;
+    struct timespec deadline;
+
+    if (timeout_ns > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ns / 1000000000LL;
+        deadline.tv_nsec += timeout_ns % 1000000000LL;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    /*! Announce the waiter before retrying, so a worker releasing events
+     *  after the retry always sees it and signals */
+    pthread_mutex_lock(&evthub->space_mutex);
+    __atomic_add_fetch(&evthub->space_waiters, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (__atomic_load_n(&evthub->exit, __ATOMIC_ACQUIRE)) {
+            s = UTILS_ERR_HUB_CLOSED;
+            break;
+        }
+        /*! the first try took the token */
+        s = data ? evthub_post_data(evthub, evt->id, evt->priority, evt->param, evt->size)
+                 : evthub_post(evthub, evt);
+        if (s != UTILS_ERR_POOL_ALLOC && s != UTILS_ERR_POOL_FULL) {
+            break;
+        }
+        if (expired) {
+            s = UTILS_ERR_TIMEOUT;
+            break;
+        }
+        if (timeout_ns < 0) {
+            pthread_cond_wait(&evthub->space_cond, &evthub->space_mutex);
+        } else if (pthread_cond_timedwait(&evthub->space_cond, &evthub->space_mutex,
+                                          &deadline) == ETIMEDOUT) {
+            expired = true;
+        }
+    }
+    __atomic_sub_fetch(&evthub->space_waiters, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&evthub->space_mutex);
+    return s;
+}
+
+int evthub_send_timed(const evthub_t handle, const event_t *evt, long long timeout_ns)
+{
+    int s;
+
+    s = evthub_send(handle, evt);
+    if (timeout_ns == 0 || (s != UTILS_ERR_POOL_ALLOC && s != UTILS_ERR_POOL_FULL)) {
+        return s;
+    }
+    return evthub_post_wait((struct evthub_handle_t*)handle, evt, false, timeout_ns);
+}
+
+int evthub_send_data(const evthub_t handle, event_id id, unsigned char priority,
+                     const void *buf, size_t len)
+{
+    int s;
+    struct evthub_handle_t *evthub;
+
+    RETURN_IF_NULL(handle, UTILS_ERR_PTR);
+    RETURN_IF_TRUE(len && !buf, UTILS_ERR_PTR);
+    evthub = (struct evthub_handle_t*)handle;
+    RETURN_IF_TRUE(len > evthub->payload, UTILS_ERR_PARAM);
+    REJECT_IF_TRUE(__atomic_load_n(&evthub->draining, __ATOMIC_RELAXED),
+                   id, priority, UTILS_ERR_HUB_CLOSED);
+    s = evthub_limited(evthub, id, priority, NULL, buf, len);
+    if (s != UTILS_SUCC) {
+        return s > 0 ? UTILS_SUCC : s;
+    }
+    return evthub_post_data(evthub, id, priority, buf, len);
+}
+
+int evthub_send_data_timed(const evthub_t handle, event_id id, unsigned char priority,
+                           const void *buf, size_t len, long long timeout_ns)
+{
+    int s;
+    event_t evt;
+
+    s = evthub_send_data(handle, id, priority, buf, len);
+    if (timeout_ns == 0 || (s != UTILS_ERR_POOL_ALLOC && s != UTILS_ERR_POOL_FULL)) {
+        return s;
+    }
+    evt.id = id;
+    evt.priority = priority;
+    evt.param = (void*)buf;
+    evt.size = (unsigned int)len;
+    return evthub_post_wait((struct evthub_handle_t*)handle, &evt, true, timeout_ns);
+}
+
+int evthub_subscribe(const evthub_t handle, event_id first, event_id last,
+                     on_event_f cb, void *user_data)
+{
+    return subs_change(handle, first, last, cb, user_data, true);
+}
+
+int evthub_unsubscribe(const evthub_t handle, event_id first, event_id last,
+                       on_event_f cb, void *user_data)
+{
+    return subs_change(handle, first, last, cb, user_data, false);
+}
+
@@ -0,0 +1,216 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef UTILS_BRIDGE_H
+#define UTILS_BRIDGE_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <condition_variable>
+#include "EventHub.h"
+#include "event_hub.h"
+
+namespace utils {
+
+/*! Wire format: each event is one frame of a 12 byte header, payload
+ *  length, event id, priority and 3 reserved bytes, integers in network
+ *  byte order, followed by the payload. The priority is an evthub one,
+ *  larger first, see ToEvthubPriority. Only the id, the priority and the
+ *  attached payload cross the bridge. */
+static const size_t kBridgeHeader = 12;
+
+/*! Default largest payload a receiver accepts, see BridgeReceiver::SetMaxFrame */
+static const size_t kBridgeMaxFrame = 16 * 1024 * 1024;
+
+/*! \brief Counters of a bridge end.
+ */
+struct BridgeStats {
+    uint64_t frames;        /*!< events written or read */
+    uint64_t batches;       /*!< writes of several frames at once, or reads */
+    uint64_t bytes;         /*!< bytes written or read, headers included */
+    uint64_t blocked;       /*!< times the sending side waited for room */
+    uint64_t dropped;       /*!< events lost to a broken connection, or refused by the hub */
+    uint64_t oversized;     /*!< connections closed on a frame over the maximum */
+    size_t queued;          /*!< events waiting to be written */
+};
+
+/*! Type of factory turning a received frame back into an event, the
+ *  default one makes events carrying the id, priority and payload */
+using BridgeFactory = std::function<SpEvent(uint32_t id, EvtPriority pri, EventBuffer payload)>;
+
+/*! \brief Sending end of a bridge, forwards events to a BridgeReceiver in
+ *         another process over a Unix-domain or TCP socket.
+ *
+ *  Subscribe it to an EventHub, or hand OnCEvent to evthub_subscribe with
+ *  the sender as user data. Events queue in a bounded queue and a writer
+ *  thread sends them in batches with one sendmsg per batch. A full queue
+ *  blocks the dispatching thread, so a slow peer fills the source hub and
+ *  its Send starts failing. Unsubscribe before destroying the sender.
+ */
+class BridgeSender : public EventHandler
+{
+  public:
+    /*! \brief Constructor
+     *  \param queue events queued before the sending side blocks
+     *  \param batch most events per write
+     */
+    explicit BridgeSender(size_t queue = 1024, size_t batch = 64);
+    virtual ~BridgeSender();
+
+    /*! \brief Connect to a receiver listening on a Unix-domain socket.
+     */
+    bool ConnectUnix(const std::string &path);
+
+    /*! \brief Connect to a receiver listening on TCP.
+     */
+    bool ConnectTcp(const std::string &host, uint16_t port);
+
+    /*! \brief Forward the event ids in [first, last], before events flow.
+     *         Every id is forwarded if no range is set.
+     */
+    void Forward(uint32_t first, uint32_t last);
+
+    virtual void OnEvent(const SpEvent evt);
+    virtual void OnEvent(const Event &evt);
+
+    /*! \brief evthub callback, user_data is the sender. The evthub_send_data
+     *         payload is copied once, evthub_send events carry none.
+     */
+    static void OnCEvent(const event_t *evt, void *user_data);
+
+    /*! \brief Queue one frame, blocks while the queue is full.
+     *  \return false if the connection is closed or broken
+     */
+    bool Post(uint32_t id, EvtPriority pri, const EventBuffer &payload);
+
+    /*! \brief Write what is queued and close the connection.
+     */
+    void Close();
+
+    BridgeStats GetStats();
+
+  private:
+    struct Frame {
+        uint32_t id;
+        EvtPriority pri;
+        EventBuffer payload;
+    };
+
+    bool Forwarded(uint32_t id) const;
+    bool Start(int fd);
+    void WriterRoutine();
+    bool WriteBatch(std::vector<Frame> &batch);
+
+  private:
+    size_t max_;
+    size_t batch_;
+    int fd_;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges_;
+    std::mutex mutex_;
+    std::condition_variable readable_;  /*!< frames queued or closing */
+    std::condition_variable writable_;  /*!< room in queue_ */
+    std::deque<Frame> queue_;
+    bool closing_;
+    bool broken_;
+    BridgeStats stats_;
+    std::thread writer_;
+};
+
+/*! \brief Receiving end of a bridge, Sends every frame it reads into an
+ *         EventHub, or into an evthub with evthub_send_data.
+ *
+ *  Connections are served one at a time on an internal thread. While the
+ *  hub is full the receiver waits for room and stops reading meanwhile, so
+ *  backpressure reaches the sender through the socket. Events the hub
+ *  refuses for good, closed, over a rejecting limit or too large, are
+ *  dropped and counted.
+ */
+class BridgeReceiver
+{
+  public:
+    /*! \brief Constructor
+     *  \param hub destination of received events
+     *  \param factory optional event factory
+     */
+    explicit BridgeReceiver(EventHub &hub, BridgeFactory factory = nullptr);
+
+    /*! \brief Constructor delivering into an evthub, frames with an id over
+     *         255 or a payload over evthub_parm::payload are dropped.
+     *  \param hub destination of received events
+     */
+    explicit BridgeReceiver(evthub_t hub);
+    virtual ~BridgeReceiver();
+
+    /*! \brief Listen on a Unix-domain socket path, replacing a stale socket.
+     */
+    bool ListenUnix(const std::string &path);
+
+    /*! \brief Listen on TCP, port 0 picks a free one, see Port.
+     */
+    bool ListenTcp(uint16_t port, const std::string &host = "127.0.0.1");
+
+    /*! \brief TCP port listened on, 0 if none.
+     */
+    uint16_t Port() const;
+
+    /*! \brief Largest payload accepted, set before listening. A frame over
+     *         it closes the connection, kBridgeMaxFrame by default.
+     */
+    void SetMaxFrame(size_t bytes);
+
+    /*! \brief Stop serving, events already delivered stay in the hub.
+     */
+    void Close();
+
+    BridgeStats GetStats();
+
+  private:
+    bool Start(int fd);
+    void Routine();
+    /*! serve one connection until it closes or Close is called */
+    void Serve(int fd);
+    /*! read exactly n bytes, false on close, error or Close */
+    bool ReadFull(int fd, void *buf, size_t n);
+    void Deliver(uint32_t id, EvtPriority pri, EventBuffer payload);
+
+  private:
+    EventHub *hub_;         /*!< nullptr if delivering into evthub_ */
+    evthub_t evthub_;
+    BridgeFactory factory_;
+    size_t max_frame_;
+    int listen_fd_;
+    int wake_[2];           /*!< pipe waking the thread on Close */
+    std::string path_;
+    std::atomic<bool> closing_;
+    std::mutex mutex_;      /*!< guards stats_ */
+    BridgeStats stats_;
+    std::thread thread_;
+};
+
+};
+
+#endif /*!< UTILS_BRIDGE_H */
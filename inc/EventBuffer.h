@@ -0,0 +1,100 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef UTILS_EVENT_BUFFER_H
+#define UTILS_EVENT_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace utils {
+
+/*! \brief Refcounted byte buffer for event payloads.
+ *
+ *  Copies share the storage and slices are views into it, so a payload
+ *  reaches any number of handlers and hubs without copying bytes. Small
+ *  buffers come from per size class slabs that are reused once released,
+ *  larger ones from the heap and very large ones from anonymous mmap.
+ *  The refcount is atomic, the bytes are not guarded: fill a buffer before
+ *  sharing it.
+ */
+class EventBuffer
+{
+  public:
+    static const size_t kMaxSlab = 64 * 1024;       /*!< largest slab size class */
+    static const size_t kMmapThreshold = 1 << 20;   /*!< from here on storage is mapped */
+
+    /*! \brief Empty buffer
+     */
+    EventBuffer() : block_(nullptr), data_(nullptr), size_(0) {}
+
+    EventBuffer(const EventBuffer &orig);
+    EventBuffer(EventBuffer &&orig) noexcept;
+    EventBuffer& operator=(const EventBuffer &orig);
+    EventBuffer& operator=(EventBuffer &&orig) noexcept;
+    ~EventBuffer();
+
+    /*! \brief Allocate size uninitialized bytes.
+     *  \return an empty buffer if memory is exhausted
+     */
+    static EventBuffer Allocate(size_t size);
+
+    /*! \brief Allocate a buffer holding a copy of size bytes at data.
+     */
+    static EventBuffer Copy(const void *data, size_t size);
+
+    const uint8_t* Data() const { return data_; }
+    /*! writable bytes, only while nothing else reads the buffer */
+    uint8_t* MutableData() { return data_; }
+    size_t Size() const { return size_; }
+    bool Empty() const { return size_ == 0; }
+
+    /*! \brief View of len bytes from offset, sharing the storage.
+     *         The range is clamped to the buffer.
+     */
+    EventBuffer Slice(size_t offset, size_t len) const;
+
+    /*! \brief Bytes of the underlying storage, at least Size().
+     */
+    size_t Capacity() const;
+
+    /*! \brief Buffers and slices sharing the storage.
+     */
+    uint32_t UseCount() const;
+
+  private:
+    struct Block;
+    class SlabPool;
+
+    EventBuffer(Block *block, uint8_t *data, size_t size)
+      : block_(block), data_(data), size_(size) {}
+    void Release();
+
+  private:
+    Block *block_;
+    uint8_t *data_;
+    size_t size_;
+};
+
+};
+
+#endif /*!< UTILS_EVENT_BUFFER_H */
@@ -21,15 +21,27 @@
 #ifndef UTILS_EVENT_HUB_CPP_H
 #define UTILS_EVENT_HUB_CPP_H
 
+#include <map>
 #include <set>
 #include <mutex>
 #include <queue>
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <functional>
+#include <unordered_map>
 #include <thread>
+#include <vector>
 #include <condition_variable>
+#include "thread_attr.h"
+#include "EventBuffer.h"
 
 namespace utils {
 class Event;
+class EventHandler;
 class EventCompare;
 
 /*! \brief A enum class for event priority
@@ -40,22 +52,168 @@ enum class EvtPriority {
     kEvtPriLow
 };
 
+/*! \brief evthub priority of an EvtPriority. evthub takes 0 to 255 with
+ *         larger first, kEvtPriHigh maps to 255 and kEvtPriLow to 0.
+ */
+inline uint8_t ToEvthubPriority(EvtPriority pri)
+{
+    switch (pri) {
+    case EvtPriority::kEvtPriHigh: return 255;
+    case EvtPriority::kEvtPriMid: return 128;
+    default: return 0;
+    }
+}
+
+/*! \brief EvtPriority of an evthub priority, 0 to 255 split in three bands.
+ */
+inline EvtPriority FromEvthubPriority(uint8_t pri)
+{
+    return pri >= 171 ? EvtPriority::kEvtPriHigh
+        : pri >= 85 ? EvtPriority::kEvtPriMid : EvtPriority::kEvtPriLow;
+}
+
 /*! Type of shared_ptr for Event */
 using SpEvent = std::shared_ptr<Event>;
 /*! Type of unique_ptr for Event */
+using UpEvent = std::unique_ptr<Event>;
+/*! Type of unique_ptr for Event */
 using UpThread = std::unique_ptr<std::thread>;
 
+/*! \brief What Send does with an event over its rate limit, see
+ *         EventHub::SetLimit.
+ */
+enum class LimitAction {
+    kDrop = 0,      /*!< discard the event, Send succeeds */
+    kReject,        /*!< Send fails */
+    kConflate       /*!< overwrite the queued event of the same id and priority */
+};
+
+/*! \brief Outcome of EventHub::SendUntil.
+ */
+enum class SendStatus {
+    kSent = 0,      /*!< queued, or dropped by a kDrop limit */
+    kFull,          /*!< still no room at the deadline */
+    kClosed,        /*!< the hub is draining or cancelled */
+    kRefused        /*!< over a kReject limit, or larger than the byte budget */
+};
+
+/*! \brief Outcome of EventHub::Drain.
+ */
+struct DrainResult {
+    size_t dispatched;  /*!< events dispatched while draining */
+    size_t dropped;     /*!< events discarded at the deadline */
+};
+
+/*! \brief Counters of EventHub, see EventHub::GetStats.
+ */
+struct HubStats {
+    uint64_t sent;          /*!< events accepted by Send */
+    uint64_t rejected;      /*!< events refused by Send */
+    uint64_t dispatched;    /*!< events taken off the queue for dispatch */
+    uint64_t high_marks;    /*!< times the depth reached the high watermark */
+    uint64_t low_marks;     /*!< times the depth fell back to the low watermark */
+    uint64_t grows;         /*!< adaptive capacity steps up */
+    uint64_t shrinks;       /*!< adaptive capacity returns to the soft limit */
+    size_t depth;           /*!< events queued now */
+    size_t peak_depth;      /*!< most events queued at once */
+    size_t capacity;        /*!< current queue limit */
+    size_t bytes;           /*!< footprint of events queued or being dispatched */
+    size_t peak_bytes;      /*!< largest bytes seen */
+    size_t byte_budget;     /*!< bytes limit, 0 if none */
+    uint64_t limited;       /*!< events over their rate limit */
+    uint64_t slow_calls;    /*!< handler calls over their budget */
+    uint64_t stalls;        /*!< handler calls flagged by the watchdog while running */
+    uint64_t isolated;      /*!< handlers moved to the isolated hub */
+    uint64_t isolated_drops;    /*!< events the isolated hub refused */
+    uint64_t filtered;      /*!< handler calls skipped by subscription filters */
+};
+
+/*! \brief A handler call over its time budget, see EventHub::SetWatchdog.
+ */
+struct SlowCall {
+    EventHandler *handler;
+    uint32_t id;                        /*!< event being handled */
+    std::chrono::microseconds elapsed;  /*!< time spent so far */
+    bool running;                       /*!< flagged by the watchdog before returning */
+    bool isolated;                      /*!< this call moved the handler to the isolated hub */
+};
+
+/*! Type of slow handler callback */
+using SlowCallCb = std::function<void(const SlowCall&)>;
+
+/*! Type of watermark callback, receives the queue depth */
+using WatermarkCb = std::function<void(size_t)>;
+/*! Type of fan-out completion callback, receives the dispatched event */
+using FanOutDoneCb = std::function<void(const Event&)>;
+
 /*! \brief Abstracted event class.
  */
 class Event
 {
   public:
+    virtual ~Event() {}
     /*! return event identifier */
     virtual uint32_t ID() const = 0;
     /*! return event description */
     virtual const char* Name() const = 0;
     /*! return event priority */
     virtual EvtPriority Priority() const = 0;
+    /*! return bytes held by the event, counted against the hub byte
+     *  budget, the attached payload unless overridden */
+    virtual size_t Footprint() const { return payload_.Size(); }
+
+    /*! attach a payload, handlers and hubs share it without copying */
+    void Attach(EventBuffer payload) { payload_ = std::move(payload); }
+    /*! return the attached payload, empty if none */
+    const EventBuffer& Payload() const { return payload_; }
+    /*! return a named field for field-match filters, false if the event
+     *  has no such field */
+    virtual bool GetField(const char* /*name*/, int64_t& /*value*/) const { return false; }
+
+  private:
+    EventBuffer payload_;
+};
+
+/*! Type of filter predicate, true lets the event reach the handler */
+using FilterFn = std::function<bool(const Event&)>;
+
+/*! \brief Comparison of a field-match term.
+ */
+enum class FieldOp { kEq, kNe, kLt, kLe, kGt, kGe };
+
+/*! \brief Term of a field-match expression, Event::GetField(field) op value.
+ */
+struct FieldMatch {
+    std::string field;
+    FieldOp op;
+    int64_t value;
+};
+
+class EventFilter;
+using SpFilter = std::shared_ptr<const EventFilter>;
+
+/*! \brief Content filter of a subscription, see EventHub::Subscribe.
+ *
+ *  Either a predicate or an expression whose terms must all match, an
+ *  event without a field fails its terms. Subscriptions sharing a filter
+ *  object share its result, it is evaluated once per event. Filters run
+ *  on the hub thread with the handlers locked: never call the hub there.
+ */
+class EventFilter
+{
+  public:
+    static SpFilter Predicate(FilterFn fn);
+    static SpFilter Match(std::vector<FieldMatch> terms);
+
+    bool Evaluate(const Event &evt) const;
+
+  private:
+    EventFilter(FilterFn fn, std::vector<FieldMatch> terms)
+      : fn_(std::move(fn)), terms_(std::move(terms)) {}
+
+  private:
+    FilterFn fn_;
+    std::vector<FieldMatch> terms_;
 };
 
 /*! \brief A abstracted class for user notification interface.
@@ -65,15 +223,54 @@ class EventHandler
   public:
     /*! user notification interface */
     virtual void OnEvent(const SpEvent evt) = 0;
+
+    /*! user notification interface for events sent as UpEvent, the event is
+     *  only valid during the call. Unless overridden, the hub hands the
+     *  event over to a shared_ptr and forwards to OnEvent(SpEvent), so the
+     *  handler may keep it or send it on.
+     */
+    virtual void OnEvent(const Event &evt)
+    {
+        OnEvent(Share(evt));
+    }
+
+  protected:
+    /*! \brief Owning SpEvent of evt. A unique event a hub dispatches on this
+     *         thread moves to a shared_ptr the hub holds while handlers run,
+     *         an event dispatched by no hub is only referenced.
+     */
+    static SpEvent Share(const Event &evt);
 };
 
-/*! \brief Event hub class.
+/*! \brief Marks the unique event a hub dispatches on this thread, so
+ *         EventHandler::Share can take it over. Hubs wrap every dispatch of
+ *         an UpEvent in one.
+ */
+class UniqueDispatch
+{
+  public:
+    /*! \param unique event being dispatched, moved to shared on Share
+     *  \param shared owner once shared, held by the hub
+     */
+    UniqueDispatch(UpEvent &unique, SpEvent &shared);
+    ~UniqueDispatch();
+    UniqueDispatch(const UniqueDispatch&) = delete;
+    UniqueDispatch& operator=(const UniqueDispatch&) = delete;
+
+  private:
+    friend class EventHandler;
+    UpEvent &unique_;
+    SpEvent &shared_;
+    UniqueDispatch *prev_;
+};
+
+/*! \brief Event hub class, its features are configured at runtime.
  */
 class EventHub
 {
   public:
 
-    /*! \brief Constructor.
+    /*! \brief Constructor, the internal thread starts on the first Send.
      *  \param max maximum number of events in queue
      */
     EventHub(size_t max);
@@ -93,6 +290,17 @@ class EventHub
      */
     bool Subscribe(EventHandler *handler);
 
+    /*! \brief Subscribe to the events with an id in [first, last] that
+     *         pass filter, replacing a former subscription of handler.
+     *         Subscriptions are indexed by id and their filters evaluated
+     *         in one pass before dispatch, so rejected handlers are never
+     *         called.
+     *  \param handler user notification handler
+     *  \param filter optional content filter
+     */
+    bool Subscribe(EventHandler *handler, uint32_t first, uint32_t last,
+                   SpFilter filter = nullptr);
+
     /*! \brief Cancel subscribed event from event hub.
      *  \param handler user notification handler
      */
@@ -102,9 +310,122 @@ class EventHub
      */
     bool Send(const SpEvent &evt);
 
+    /*! \brief Asynchronous sending event method, the hub owns the event and
+     *         destroys it after dispatch. evt is left untouched on failure.
+     */
+    bool Send(UpEvent &&evt);
+
+    /*! \brief Send waiting for room while the hub is full or out of bytes.
+     *         The internal thread signals waiters after each dispatch, only
+     *         kFull is worth retrying.
+     *  \param deadline time point to give up waiting
+     */
+    SendStatus SendUntil(const SpEvent &evt, std::chrono::steady_clock::time_point deadline);
+
     /*! \brief Discard unprocessed event and terminate EventHub.
      */
     void Cancel();
+
+    /*! \brief Stop accepting events, dispatch the pending ones in batches
+     *         and terminate EventHub. Events still queued at the deadline
+     *         are discarded.
+     *  \param deadline time point to give up dispatching
+     */
+    DrainResult Drain(std::chrono::steady_clock::time_point deadline);
+
+    /*! \brief Watch the queue depth, set before the first Send.
+     *         on_high runs on the sending thread when the depth reaches
+     *         high, on_low runs on the hub thread when it falls back to low.
+     *  \param high depth that fires on_high
+     *  \param low depth that fires on_low once high was reached, below high
+     *  \param on_high callback for the rising edge
+     *  \param on_low callback for the falling edge
+     *  Callbacks run on the thread that crossed a mark, or on the one still
+     *  running the previous callback. They never overlap, they alternate,
+     *  and the last one matches the depth.
+     */
+    bool SetWatermarks(size_t high, size_t low, WatermarkCb on_high, WatermarkCb on_low);
+
+    /*! \brief Let capacity grow under load, set before the first Send.
+     *         A full queue grows by step up to hard, and goes back to soft
+     *         and releases its memory once it stayed empty for 100 ms.
+     *  \param soft capacity when idle, replaces max
+     *  \param hard capacity never exceeded
+     *  \param step growth per full Send
+     */
+    bool SetAdaptive(size_t soft, size_t hard, size_t step);
+
+    /*! \brief Bound the memory of queued events as well as their number.
+     *         Send fails when the footprint of the events queued or being
+     *         dispatched would exceed bytes. Construct with a large max to
+     *         limit by bytes only.
+     *  \param bytes budget, 0 removes it
+     */
+    void SetByteBudget(size_t bytes);
+
+    /*! \brief Snapshot of counters.
+     */
+    HubStats GetStats();
+
+    /*! \brief Start the internal thread now with affinity, scheduling
+     *         class, stack size and name, instead of on the first Send.
+     *  \return false if the thread was already started or attr could not
+     *          be applied, it runs with default attributes then
+     */
+    bool SetThread(const thread_attr &attr);
+
+    /*! \brief Limit the send rate of the event ids in [first, last], all
+     *         ids of the range share one token bucket of burst events
+     *         refilled at rate per second. The check takes no lock.
+     *         kConflate queues the event when none of its id is pending.
+     *  \param rate events per second, 0 removes the range
+     *  \param burst events accepted at once
+     *  \return false if the range overlaps another limit without matching it
+     */
+    bool SetLimit(uint32_t first, uint32_t last, double rate, size_t burst,
+                  LimitAction action);
+
+    /*! \brief Run the handlers of one event concurrently, set before the
+     *         first Send. The hub thread calls one handler and a pool calls
+     *         the others. Unless ordered, the next event may start while
+     *         handlers of the previous one still run, and a handler may be
+     *         called shortly after UnSubscribe returned. An event counts
+     *         against the capacity and the byte budget until its last
+     *         handler returned, so slow handlers fill the hub.
+     *  \param workers pool threads besides the hub thread
+     *  \param ordered wait for all handlers of an event before the next one
+     *  \param done optional callback once all handlers of an event returned
+     */
+    bool SetFanOut(size_t workers, bool ordered, FanOutDoneCb done = nullptr);
+
+    /*! \brief Record every accepted event to a binary trace file (see
+     *         evttrace.h), or stop recording with path nullptr. Start and
+     *         stop while no thread is sending.
+     *  \param path trace file to create, replacing the current one
+     */
+    bool SetTrace(const char *path);
+
+    /*! \brief Time every handler call against a budget, set before the
+     *         first Send. Calls are timed with steady_clock, no syscall
+     *         per dispatch. A watchdog thread flags calls still running
+     *         past their budget, the hub thread reports finished ones.
+     *         Handlers run by fan-out are not timed.
+     *  \param budget default budget of every handler
+     *  \param report optional callback, on the watchdog thread for running
+     *         calls and on the hub thread for finished ones
+     *  \param isolate_after move a handler to an isolated internal hub after
+     *         this many slow calls, 0 never. Unique events are shared then.
+     */
+    bool SetWatchdog(std::chrono::microseconds budget, SlowCallCb report = nullptr,
+                     size_t isolate_after = 0);
+
+    /*! \brief Budget of one subscribed handler, overrides the default.
+     */
+    bool SetBudget(EventHandler *handler, std::chrono::microseconds budget);
+
+    /*! \brief Slow calls counted for a subscribed handler.
+     */
+    size_t SlowCalls(EventHandler *handler);
 #ifdef TEST_ON
     /*! \brief Unblocks waiting thread of EventHub
      *         Only for test mode
@@ -118,41 +439,217 @@ class EventHub
 #endif
 
   private:
+    class FanOutPool;
+    class Watchdog;
+
+    /*! \brief GCRA limiter of one id range, tat is the time the bucket is
+     *         theoretically empty again
+     */
+    struct Limiter {
+        uint32_t first;
+        uint32_t last;
+        int64_t interval;   /*!< nanoseconds per event */
+        int64_t span;       /*!< interval times burst */
+        LimitAction action;
+        mutable std::atomic<int64_t> tat;
+        /*! take a token, no lock */
+        bool Admit() const;
+    };
+    /*! Limiters sorted by range, never modified once published */
+    using LimitMap = std::vector<const Limiter*>;
+
+    /*! \brief Subscription and watchdog state of a subscribed handler
+     */
+    struct HandlerInfo {
+        uint32_t first = 0;
+        uint32_t last = UINT32_MAX;
+        SpFilter filter;
+        std::chrono::microseconds budget{0};    /*!< 0 uses the default */
+        size_t slow_calls = 0;
+        bool isolated = false;  /*!< served by isolated_ instead */
+    };
+    using Targets = std::vector<std::pair<EventHandler*, HandlerInfo*>>;
+
+    /*! \brief Handlers subscribed to one id and the distinct filters they
+     *         use, pointers into handlers_ valid until it changes
+     */
+    struct Route {
+        Targets handlers;
+        std::vector<int> slots;     /*!< filter of each handler, -1 if none */
+        std::vector<const EventFilter*> filters;
+    };
+
     /*! \brief A element of priority queue
      */
     class Element {
       public:
-        Element() : evt_(), seq_(0) {}
+        Element()
+          : evt_(), uevt_(), pri_(EvtPriority::kEvtPriLow), seq_(0), bytes_(0), unique_(false) {}
         Element(const SpEvent &evt, uint32_t seq)
-          : evt_(evt), seq_(seq) {}
+          : evt_(evt), uevt_(), pri_(evt->Priority()), seq_(seq)
+          , bytes_(evt->Footprint()), unique_(false) {}
+        Element(UpEvent &&evt, uint32_t seq)
+          : evt_(), uevt_(std::move(evt)), pri_(uevt_->Priority()), seq_(seq)
+          , bytes_(uevt_->Footprint()), unique_(true) {}
+        Element(Element&&) = default;
+        Element& operator=(Element&&) = default;
+        /*! compares cached fields only, so moved-from elements still order */
         bool operator<(const Element &orig) const;
-        SpEvent evt_;
+        const Event& Evt() const { return uevt_ ? *uevt_ : *evt_; }
+        SpEvent evt_;       /*!< set for shared events */
+        UpEvent uevt_;      /*!< set for unique events */
+        EvtPriority pri_;
         uint32_t seq_;
+        size_t bytes_;      /*!< footprint cached on Send */
+        bool unique_;       /*!< sent as UpEvent, evt_ owns it once shared */
     };
 
-    /*! Type of priority_queue for SpEvent */
-    using EvtQueue = std::priority_queue<Element>;
+    /*! \brief priority_queue for Element whose storage can be released
+     */
+    class EvtQueue : public std::priority_queue<Element> {
+      public:
+        void ShrinkToFit() { c.shrink_to_fit(); }
+        /*! queued element with the same id and priority as e, nullptr if none */
+        Element* Pending(const Element &e)
+        {
+            uint32_t id = e.Evt().ID();
+            for (auto &q : c) {
+                if (q.pri_ == e.pri_ && q.Evt().ID() == id) {
+                    return &q;
+                }
+            }
+            return nullptr;
+        }
+        /*! overwrite the event of a pending element, e gets the old one
+         *  back, the order only depends on fields kept */
+        static void Conflate(Element &pending, Element &e)
+        {
+            std::swap(pending.evt_, e.evt_);
+            std::swap(pending.uevt_, e.uevt_);
+            std::swap(pending.bytes_, e.bytes_);
+            std::swap(pending.unique_, e.unique_);
+        }
+        size_t Bytes() const
+        {
+            size_t bytes = 0;
+            for (auto &e : c) bytes += e.bytes_;
+            return bytes;
+        }
+    };
 
   private:
+    /*! \brief Start internal thread once.
+     *  \return whether this call started it with attr
+     */
+    bool Start(const thread_attr *attr = nullptr);
+
+    /*! \brief Join internal thread if it runs.
+     */
+    void JoinThread();
+
     /*! \brief Start routine for internal thread.
      */
     void StartRoutine();
+    static void* ThreadRoutine(void *arg);
 
     /*! \brief Loop event queue and notify user.
      */
     bool EventLoop();
 
+    /*! \brief Rebuild the unfiltered route and drop the per id ones,
+     *         under h_mutex_.
+     */
+    void Reroute();
+
+    /*! \brief Handlers the event of e goes to, under h_mutex_.
+     */
+    const Targets& Select(const Element &e);
+
+    /*! \brief Call one handler with the event of e.
+     */
+    static void Notify(EventHandler *handler, Element &e);
+
+    /*! \brief Call one handler under the watchdog, under h_mutex_.
+     *         Isolates the handler after too many slow calls.
+     */
+    void TimedNotify(EventHandler *handler, HandlerInfo &info, Element &e);
+
+    /*! \brief Count a call flagged by the watchdog thread.
+     */
+    void OnStall();
+
+    /*! \brief Queue a element unless the hub is stopping or full.
+     *  \param admit whether the rate limit applies, a retry already took its token
+     */
+    SendStatus Push(Element &&e, bool admit = true);
+
+    /*! \brief Account popped events, under e_mutex_.
+     *  \return whether the low watermark was crossed
+     */
+    bool OnPopped(size_t n);
+
+    /*! \brief Run on_high or on_low until they report the current state,
+     *         unless another thread is already doing so.
+     */
+    void DeliverMarks();
+
+    /*! \brief Release n dispatched events of bytes footprint, waking
+     *         SendUntil and Drain.
+     */
+    void Release(size_t n, size_t bytes);
+
   private:
     std::mutex e_mutex_; /*!< use for evtque_ */
     std::mutex h_mutex_; /*! use for handlers_ */
     std::condition_variable cond_;
     uint32_t seq_no_;
     EvtQueue evtque_;
-    size_t max_size_;
+    size_t max_size_;               /*!< current capacity */
+    size_t soft_size_;              /*!< adaptive capacity when idle */
+    size_t hard_size_;              /*!< adaptive capacity limit */
+    size_t step_size_;
+    size_t byte_budget_;            /*!< 0 if none */
+    std::atomic<size_t> bytes_;     /*!< footprint queued or being dispatched */
+    size_t high_mark_;
+    size_t low_mark_;
+    bool above_high_;               /*!< high reached, low not yet */
+    bool marked_high_;              /*!< state the callbacks last reported */
+    bool marking_;                  /*!< a thread is in DeliverMarks */
+    WatermarkCb on_high_;
+    WatermarkCb on_low_;
+    HubStats stats_;
     EventHandler *handler_;
-    std::set<EventHandler*>  handlers_;
-    UpThread thread_;
+    std::map<EventHandler*, HandlerInfo> handlers_;
+    Route all_;                     /*!< every handler, used while none narrows */
+    size_t narrowed_;               /*!< subscriptions with a range or filter */
+    std::unordered_map<uint32_t, Route> routes_;    /*!< built on the first event of an id */
+    std::vector<char> matches_;     /*!< filter results for one event */
+    Targets targets_;               /*!< handlers selected for one event */
+    std::atomic<uint64_t> filtered_;
     bool exit_;
+    std::atomic<bool> draining_;    /*!< set by Drain, sends are rejected */
+    std::atomic<size_t> inflight_;  /*!< events popped and being dispatched, fan-out included */
+    size_t dispatched_;             /*!< events dispatched while draining */
+    std::condition_variable drain_cond_;
+    std::condition_variable space_cond_;    /*!< room released, for SendUntil */
+    std::atomic<size_t> space_waiters_;
+    uint64_t space_gen_;            /*!< dispatches seen by waiters, under e_mutex_ */
+    std::vector<Element> batch_;    /*!< events popped by the internal thread */
+    std::atomic<FILE*> trace_;
+    std::atomic<const LimitMap*> limits_;   /*!< nullptr if there are none */
+    std::atomic<uint64_t> limited_;
+    std::mutex l_mutex_;                    /*!< serializes SetLimit */
+    std::vector<std::unique_ptr<Limiter>> limiters_;
+    std::vector<std::unique_ptr<const LimitMap>> limit_maps_;   /*!< kept for lock-free readers */
+    std::unique_ptr<FanOutPool> fanout_;
+    std::unique_ptr<Watchdog> watchdog_;
+    std::unique_ptr<EventHub> isolated_;    /*!< runs handlers isolated by the watchdog */
+    size_t isolate_after_;
+    bool fanout_ordered_;
+    std::vector<EventHandler*> fanout_handlers_;    /*!< handlers_ copy for one fan-out */
+    std::once_flag start_once_;
+    pthread_t thread_;
+    bool joinable_;                 /*!< thread_ started and not joined */
 };
 
 };
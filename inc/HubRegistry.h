@@ -0,0 +1,76 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef UTILS_HUB_REGISTRY_H
+#define UTILS_HUB_REGISTRY_H
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "EventHub.h"
+#include "Singleton.h"
+
+namespace utils {
+
+/*! \brief Process wide registry of named event hubs.
+ *
+ *  Hubs are created on first use and live until the registry is destroyed
+ *  at exit, their threads start on the first Send. Lookups read an
+ *  immutable snapshot of the name map and take no lock, creating a hub
+ *  publishes a new snapshot under a mutex.
+ */
+class HubRegistry : public Singleton<HubRegistry>
+{
+    friend class Singleton<HubRegistry>;
+
+  public:
+    /*! \brief Get the hub registered under name, create it if there is none.
+     *  \param name hub name
+     *  \param max maximum number of events in queue, used on creation only
+     */
+    EventHub& Get(const std::string &name, size_t max);
+
+    /*! \brief Find the hub registered under name.
+     *  \param name hub name
+     *  \return the hub or nullptr if it was never created
+     */
+    EventHub* Find(const std::string &name) const;
+
+  private:
+    /*! Type of name map, never modified once published */
+    using HubMap = std::map<std::string, EventHub*>;
+
+    HubRegistry();
+    virtual ~HubRegistry();
+
+  private:
+    std::mutex mutex_;  /*!< serializes creation */
+    std::atomic<const HubMap*> map_;
+    std::vector<std::unique_ptr<const HubMap>> snapshots_;  /*!< kept for lock-free readers */
+    std::vector<std::unique_ptr<EventHub>> hubs_;
+};
+
+};
+
+#endif /*!< UTILS_HUB_REGISTRY_H */
@@ -0,0 +1,119 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef UTILS_PIPELINE_H
+#define UTILS_PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "EventHub.h"
+
+namespace utils {
+
+/*! Type of pipeline stage, returns the event for the next stage or
+ *  nullptr to end it here. The output of the last stage is discarded. */
+using StageFn = std::function<SpEvent(SpEvent)>;
+
+/*! \brief Counters of one pipeline stage, see Pipeline::GetStats.
+ */
+struct StageStats {
+    std::string name;
+    size_t workers;
+    uint64_t processed;         /*!< events run through the stage */
+    uint64_t filtered;          /*!< events the stage returned nullptr for */
+    uint64_t stalls;            /*!< times a worker blocked on a full next queue */
+    std::chrono::nanoseconds busy;  /*!< time spent in the stage function */
+    size_t occupancy;           /*!< events waiting in the input queue */
+    size_t capacity;            /*!< input queue capacity */
+};
+
+/*! \brief Chain of stages connected by bounded lock-free queues.
+ *
+ *  Each stage runs its function on a number of worker threads. Workers
+ *  pop a batch from the stage's input queue and push the results to the
+ *  next one as a batch, waking sleeping readers once per batch. A full
+ *  queue blocks its writers, so a slow stage holds back the stages before
+ *  it and finally Send. Events keep their order only through stages with
+ *  one worker.
+ */
+class Pipeline
+{
+  public:
+    /*! \brief Constructor
+     *  \param capacity capacity of each queue, rounded up to a power of 2
+     *  \param batch most events a worker moves at once
+     */
+    explicit Pipeline(size_t capacity = 1024, size_t batch = 32);
+
+    /*! \brief Destructor, stops the pipeline
+     */
+    virtual ~Pipeline();
+
+    /*! \brief Append a stage, before Start.
+     *  \param name stage name in GetStats
+     *  \param fn stage function, called concurrently when workers > 1
+     *  \param workers number of worker threads
+     */
+    bool AddStage(const std::string &name, StageFn fn, size_t workers = 1);
+
+    /*! \brief Start the workers of every stage.
+     */
+    bool Start();
+
+    /*! \brief Feed an event to the first stage, blocks while its queue
+     *         is full.
+     *  \return false if the pipeline is not running
+     */
+    bool Send(SpEvent evt);
+
+    /*! \brief Stop taking events, let every stage finish the queued ones
+     *         and join the workers.
+     */
+    void Stop();
+
+    /*! \brief Counters of every stage in order.
+     */
+    std::vector<StageStats> GetStats() const;
+
+  private:
+    class Queue;
+    struct Stage;
+
+    /*! \brief Worker routine of stage i
+     */
+    void Routine(size_t i);
+
+  private:
+    size_t capacity_;
+    size_t batch_;
+    std::vector<std::unique_ptr<Stage>> stages_;
+    std::atomic<bool> running_;
+    std::atomic<int> senders_;  /*!< Send calls in progress */
+};
+
+};
+
+#endif /*!< UTILS_PIPELINE_H */
@@ -21,7 +21,9 @@
 
 namespace utils {
 
-/// NOTE: thread safe is not considered
+/// NOTE: GetInstance is thread safe, the local static is constructed once
+///       even when first called from several threads (C++11). The instance
+///       itself must guard its own state.
 template<typename T>
 class Singleton
 {
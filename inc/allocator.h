@@ -21,6 +21,7 @@
 #ifndef UTILS_ALLOCATOR_H
 #define UTILS_ALLOCATOR_H
 
+#include <sched.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include "list.h"
@@ -38,8 +39,8 @@
     };                                      \
     struct PRODUCT##_allocator {            \
         pthread_mutex_t mutex;              \
-        unsigned char size;                 \
-        unsigned int *bits;                 \
+        unsigned int size;                  \
+        struct hbitmap bits;                \
         struct PRODUCT##_element *array;    \
     }
 
@@ -57,43 +58,45 @@
 
 #define ALLOCATOR_IMPLEMENT(PRODUCT, TYPE)                                      \
     static int PRODUCT##_allocator_create(                                      \
-        struct PRODUCT##_allocator *inst, unsigned char size)                   \
+        struct PRODUCT##_allocator *inst, unsigned int size)                    \
     {                                                                           \
         char *mem;                                                              \
-        unsigned int b_size, e_size;                                            \
+        size_t b_size, e_size;                                                  \
         RETURN_IF_TRUE(!size, UTILS_ERR_POOL_SIZE);                             \
+        RETURN_IF_TRUE(size > (1u << 30), UTILS_ERR_POOL_SIZE);                 \
         memset(inst, 0, sizeof(struct PRODUCT##_allocator));                    \
-        b_size = sizeof(unsigned int) * BITS_TO_WORDS(size);                    \
+        b_size = sizeof(unsigned long long) * hbitmap_words((int)size);         \
         e_size = sizeof(struct PRODUCT##_element) * size;                       \
-        mem = (char*)malloc(b_size + e_size);                                   \
+        e_size = (e_size + sizeof(unsigned long long) - 1)                      \
+                 & ~(sizeof(unsigned long long) - 1);                           \
+        mem = (char*)malloc(e_size + b_size);                                   \
         RETURN_IF_NULL(mem, UTILS_ERR_POOL_MEM);                                \
         pthread_mutex_init(&inst->mutex, NULL);                                 \
-        inst->bits = (unsigned int*)mem;                                        \
         inst->size = size;                                                      \
-        inst->array = (struct PRODUCT##_element*)(mem + b_size);                \
-        bitmask_init(inst->bits, (int)inst->size);                              \
+        inst->array = (struct PRODUCT##_element*)mem;                           \
+        hbitmap_init(&inst->bits, (unsigned long long*)(mem + e_size),          \
+                     (int)inst->size);                                          \
         return UTILS_SUCC;                                                      \
     };                                                                          \
     static void PRODUCT##_allocator_destory(struct PRODUCT##_allocator *inst)   \
     {                                                                           \
-        if (inst->bits) {                                                       \
-            free(inst->bits);                                                   \
-            inst->bits = NULL;                                                  \
+        if (inst->array) {                                                      \
+            free(inst->array);                                                  \
             inst->array = NULL;                                                 \
+            inst->bits.leaf = NULL;                                             \
         }                                                                       \
         inst->size = 0;                                                         \
         pthread_mutex_destroy(&inst->mutex);                                    \
     };                                                                          \
     static TYPE* PRODUCT##_allocator_alloc(struct PRODUCT##_allocator *inst)    \
     {                                                                           \
-        int max, bit;                                                           \
+        int bit;                                                                \
         TYPE* s = NULL;                                                         \
         pthread_mutex_lock(&inst->mutex);                                       \
-        max = (int)inst->size;                                                  \
-        bit = bitmask_ffz(inst->bits, max);                                     \
-        if (bit >= 0 && bit < max) {                                            \
+        bit = hbitmap_ffz(&inst->bits);                                         \
+        if (bit >= 0) {                                                         \
             inst->array[bit].bit = bit;                                         \
-            bitmask_set(inst->bits, bit);                                       \
+            hbitmap_set(&inst->bits, bit);                                      \
             s = &inst->array[bit].element;                                      \
         }                                                                       \
         pthread_mutex_unlock(&inst->mutex);                                     \
@@ -106,13 +109,300 @@
         e = container_of(element, struct PRODUCT##_element, element);           \
         if (e->bit >= 0 && e->bit < (int)inst->size) {                          \
             pthread_mutex_lock(&inst->mutex);                                   \
-            bitmask_clear(inst->bits, e->bit);                                  \
+            hbitmap_clear(&inst->bits, e->bit);                                 \
             pthread_mutex_unlock(&inst->mutex);                                 \
             return UTILS_SUCC;                                                  \
         }                                                                       \
         return UTILS_ERR_POOL_FREE;                                             \
     }
 
+/*
+ * Lock-free variant of the allocator above.
+ *
+ * Free elements are kept on a Treiber stack of element indices. The stack head
+ * packs a 32-bit modification tag with the index of the top element into one
+ * 64-bit word, so a single compare-and-swap pops or pushes an element and the
+ * tag protects against ABA when an element is popped and pushed back between
+ * the read and the swap of another thread. Both alloc and free are O(1) and
+ * never block.
+ *
+ * Elements live in contiguous slabs of `size` elements. With a non-zero
+ * `ceiling` the pool grows by one slab whenever it runs dry, until `ceiling`
+ * elements are reached; growing is the only path that takes the mutex.
+ * LF_ALLOCATOR_SHRINK releases the topmost slabs again once all of their
+ * elements are free, it is meant to be called while the owner is idle. To
+ * that end a growable pool counts the allocs walking the free list, the
+ * counter sits a cache line away from the head and fixed pools skip it.
+ *
+ * LF_ALLOCATOR_CREATE_EXTRA reserves `extra` bytes behind every element,
+ * reachable through LF_ALLOCATOR_EXTRA, for data whose size is only known
+ * at runtime.
+ */
+#define LF_ALLOCATOR_NIL            (0xFFFFFFFFu)
+#define LF_ALLOCATOR_CACHELINE      (64)
+#define LF_TAG_INDEX(v)             ((unsigned int)(v))
+#define LF_TAG_COUNT(v)             ((unsigned int)((v) >> 32))
+#define LF_TAG_MAKE(count, index)   \
+    (((unsigned long long)(count) << 32) | (unsigned int)(index))
+
+#define LF_ALLOCATOR_AT(inst, idx)  \
+    ((__typeof__((inst)->array[0]))((char*)(inst)->array[(idx) / (inst)->slab] \
+        + (size_t)((idx) % (inst)->slab) * (inst)->stride))
+
+#define LF_ALLOCATOR_DECLARE(PRODUCT, TYPE) \
+    struct PRODUCT##_lfelement {            \
+        unsigned int next;                  \
+        unsigned int index;                 \
+        TYPE element;                       \
+    };                                      \
+    struct PRODUCT##_lfallocator {          \
+        unsigned long long head;            \
+        unsigned int size;                  \
+        unsigned int slab;                  \
+        unsigned int slabs;                 \
+        unsigned int max_slabs;             \
+        size_t stride;                      \
+        pthread_mutex_t mutex;              \
+        struct PRODUCT##_lfelement **array; \
+        char pad[LF_ALLOCATOR_CACHELINE];   \
+        unsigned int poppers;               \
+    }
+
+#define LF_ALLOCATOR_DEFINE(PRODUCT, VAR)           \
+    struct PRODUCT##_lfallocator  VAR
+
+#define LF_ALLOCATOR_CREATE(PRODUCT, allocator, size, ceiling)  \
+    PRODUCT##_lfallocator_create(allocator, size, ceiling, 0)
+#define LF_ALLOCATOR_CREATE_EXTRA(PRODUCT, allocator, size, ceiling, extra) \
+    PRODUCT##_lfallocator_create(allocator, size, ceiling, extra)
+#define LF_ALLOCATOR_EXTRA(PRODUCT, elem)               \
+    ((void*)(container_of(elem, struct PRODUCT##_lfelement, element) + 1))
+#define LF_ALLOCATOR_DESTORY(PRODUCT, allocator)        \
+    PRODUCT##_lfallocator_destory(allocator)
+#define LF_ALLOCATOR_ALLOC(PRODUCT, allocator)          \
+    PRODUCT##_lfallocator_alloc(allocator)
+#define LF_ALLOCATOR_FREE(PRODUCT, allocator, element)  \
+    PRODUCT##_lfallocator_free(allocator, element)
+#define LF_ALLOCATOR_FREE_BULK(PRODUCT, allocator, elements, n) \
+    PRODUCT##_lfallocator_free_bulk(allocator, elements, n)
+#define LF_ALLOCATOR_SHRINK(PRODUCT, allocator)         \
+    PRODUCT##_lfallocator_shrink(allocator)
+
+#define LF_ALLOCATOR_IMPLEMENT(PRODUCT, TYPE)                                   \
+    static inline void PRODUCT##_lfallocator_push(                              \
+        struct PRODUCT##_lfallocator *inst,                                     \
+        unsigned int first, struct PRODUCT##_lfelement *last)                   \
+    {                                                                           \
+        unsigned long long old, neu;                                            \
+        old = __atomic_load_n(&inst->head, __ATOMIC_RELAXED);                   \
+        do {                                                                    \
+            __atomic_store_n(&last->next, LF_TAG_INDEX(old), __ATOMIC_RELAXED); \
+            neu = LF_TAG_MAKE(LF_TAG_COUNT(old) + 1, first);                    \
+        } while (!__atomic_compare_exchange_n(&inst->head, &old, neu, true,     \
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));                       \
+    };                                                                          \
+    static inline int PRODUCT##_lfallocator_grow(                               \
+        struct PRODUCT##_lfallocator *inst)                                     \
+    {                                                                           \
+        unsigned int i, base;                                                   \
+        struct PRODUCT##_lfelement *mem, *e = NULL;                             \
+        pthread_mutex_lock(&inst->mutex);                                       \
+        if (LF_TAG_INDEX(__atomic_load_n(&inst->head, __ATOMIC_ACQUIRE))        \
+                != LF_ALLOCATOR_NIL) {                                          \
+            /*! another thread has grown the pool or freed an element */        \
+            pthread_mutex_unlock(&inst->mutex);                                 \
+            return UTILS_SUCC;                                                  \
+        }                                                                       \
+        if (inst->slabs >= inst->max_slabs) {                                   \
+            pthread_mutex_unlock(&inst->mutex);                                 \
+            return UTILS_ERR_POOL_FULL;                                         \
+        }                                                                       \
+        mem = (struct PRODUCT##_lfelement*)calloc(inst->slab, inst->stride);    \
+        if (mem == NULL) {                                                      \
+            pthread_mutex_unlock(&inst->mutex);                                 \
+            return UTILS_ERR_POOL_MEM;                                          \
+        }                                                                       \
+        base = inst->slabs * inst->slab;                                        \
+        inst->array[inst->slabs] = mem;                                         \
+        for (i = 0; i < inst->slab; i++) {                                      \
+            e = LF_ALLOCATOR_AT(inst, base + i);                                \
+            e->index = base + i;                                                \
+            e->next = base + i + 1;                                             \
+        }                                                                       \
+        __atomic_store_n(&inst->slabs, inst->slabs + 1, __ATOMIC_RELEASE);      \
+        __atomic_store_n(&inst->size, inst->size + inst->slab,                  \
+                         __ATOMIC_RELEASE);                                     \
+        PRODUCT##_lfallocator_push(inst, base, e);                              \
+        pthread_mutex_unlock(&inst->mutex);                                     \
+        return UTILS_SUCC;                                                      \
+    };                                                                          \
+    static inline int PRODUCT##_lfallocator_create(                             \
+        struct PRODUCT##_lfallocator *inst,                                     \
+        unsigned int size, unsigned int ceiling, size_t extra)                  \
+    {                                                                           \
+        int s;                                                                  \
+        unsigned long long slabs;                                               \
+        RETURN_IF_TRUE(!size, UTILS_ERR_POOL_SIZE);                             \
+        slabs = 1;                                                              \
+        if (ceiling > size) {                                                   \
+            slabs = (ceiling + (unsigned long long)size - 1) / size;            \
+        }                                                                       \
+        RETURN_IF_TRUE(slabs * size >= LF_ALLOCATOR_NIL, UTILS_ERR_POOL_SIZE);  \
+        memset(inst, 0, sizeof(struct PRODUCT##_lfallocator));                  \
+        inst->array = (struct PRODUCT##_lfelement**)calloc(                     \
+            (size_t)slabs, sizeof(struct PRODUCT##_lfelement*));                \
+        RETURN_IF_NULL(inst->array, UTILS_ERR_POOL_MEM);                        \
+        inst->slab = size;                                                      \
+        inst->max_slabs = (unsigned int)slabs;                                  \
+        /*! extra bytes trail every element, padded to keep them aligned */   \
+        inst->stride = sizeof(struct PRODUCT##_lfelement) + extra;              \
+        inst->stride = (inst->stride + __alignof__(struct PRODUCT##_lfelement)  \
+            - 1) / __alignof__(struct PRODUCT##_lfelement)                      \
+            * __alignof__(struct PRODUCT##_lfelement);                          \
+        inst->head = LF_TAG_MAKE(0, LF_ALLOCATOR_NIL);                          \
+        pthread_mutex_init(&inst->mutex, NULL);                                 \
+        s = PRODUCT##_lfallocator_grow(inst);                                   \
+        if (s != UTILS_SUCC) {                                                  \
+            pthread_mutex_destroy(&inst->mutex);                                \
+            free(inst->array);                                                  \
+            inst->array = NULL;                                                 \
+        }                                                                       \
+        return s;                                                               \
+    };                                                                          \
+    static inline void PRODUCT##_lfallocator_destory(                           \
+        struct PRODUCT##_lfallocator *inst)                                     \
+    {                                                                           \
+        unsigned int i;                                                         \
+        if (inst->array) {                                                      \
+            for (i = 0; i < inst->slabs; i++) {                                 \
+                free(inst->array[i]);                                           \
+            }                                                                   \
+            free(inst->array);                                                  \
+            inst->array = NULL;                                                 \
+            pthread_mutex_destroy(&inst->mutex);                                \
+        }                                                                       \
+        inst->size = 0;                                                         \
+        inst->slabs = 0;                                                        \
+        inst->head = LF_TAG_MAKE(0, LF_ALLOCATOR_NIL);                          \
+    };                                                                          \
+    static inline TYPE* PRODUCT##_lfallocator_alloc(                            \
+        struct PRODUCT##_lfallocator *inst)                                     \
+    {                                                                           \
+        unsigned int idx, next;                                                 \
+        unsigned long long old, neu;                                            \
+        struct PRODUCT##_lfelement *e;                                          \
+        int shrinks = inst->max_slabs > 1; /*! a fixed pool never shrinks */    \
+        do {                                                                    \
+            /*! announce the walk so shrink never frees a slab under us */      \
+            if (shrinks) {                                                      \
+                __atomic_add_fetch(&inst->poppers, 1, __ATOMIC_SEQ_CST);        \
+            }                                                                   \
+            old = __atomic_load_n(&inst->head, __ATOMIC_SEQ_CST);               \
+            do {                                                                \
+                idx = LF_TAG_INDEX(old);                                        \
+                if (idx == LF_ALLOCATOR_NIL) {                                  \
+                    break;                                                      \
+                }                                                               \
+                /*! a stale next is harmless, the tag makes the swap fail */    \
+                e = LF_ALLOCATOR_AT(inst, idx);                                 \
+                next = __atomic_load_n(&e->next, __ATOMIC_RELAXED);             \
+                neu = LF_TAG_MAKE(LF_TAG_COUNT(old) + 1, next);                 \
+            } while (!__atomic_compare_exchange_n(&inst->head, &old, neu, true, \
+                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));                   \
+            if (shrinks) {                                                      \
+                __atomic_sub_fetch(&inst->poppers, 1, __ATOMIC_RELEASE);        \
+            }                                                                   \
+            if (idx != LF_ALLOCATOR_NIL) {                                      \
+                return &e->element;                                             \
+            }                                                                   \
+        } while (PRODUCT##_lfallocator_grow(inst) == UTILS_SUCC);               \
+        return NULL;                                                            \
+    };                                                                          \
+    static inline int PRODUCT##_lfallocator_free(                               \
+            struct PRODUCT##_lfallocator *inst, TYPE *element)                  \
+    {                                                                           \
+        struct PRODUCT##_lfelement *e;                                          \
+        e = container_of(element, struct PRODUCT##_lfelement, element);         \
+        RETURN_IF_TRUE(e->index >= inst->max_slabs * inst->slab,                \
+                       UTILS_ERR_POOL_FREE);                                    \
+        PRODUCT##_lfallocator_push(inst, e->index, e);                          \
+        return UTILS_SUCC;                                                      \
+    };                                                                          \
+    static inline int PRODUCT##_lfallocator_free_bulk(                          \
+        struct PRODUCT##_lfallocator *inst, TYPE **elements, unsigned int n)    \
+    {                                                                           \
+        unsigned int i, limit = inst->max_slabs * inst->slab;                   \
+        struct PRODUCT##_lfelement *e, *prev = NULL;                            \
+        /*! chain the elements up and push them with a single swap */           \
+        for (i = 0; i < n; i++) {                                               \
+            e = container_of(elements[i], struct PRODUCT##_lfelement, element); \
+            RETURN_IF_TRUE(e->index >= limit, UTILS_ERR_POOL_FREE);             \
+            if (prev) {                                                         \
+                __atomic_store_n(&prev->next, e->index, __ATOMIC_RELAXED);      \
+            }                                                                   \
+            prev = e;                                                           \
+        }                                                                       \
+        if (prev) {                                                             \
+            e = container_of(elements[0], struct PRODUCT##_lfelement, element); \
+            PRODUCT##_lfallocator_push(inst, e->index, prev);                   \
+        }                                                                       \
+        return UTILS_SUCC;                                                      \
+    };                                                                          \
+    static inline int PRODUCT##_lfallocator_shrink(                             \
+        struct PRODUCT##_lfallocator *inst)                                     \
+    {                                                                           \
+        unsigned int idx, keep, *nfree;                                         \
+        unsigned int first = LF_ALLOCATOR_NIL;                                  \
+        unsigned long long old, neu;                                            \
+        struct PRODUCT##_lfelement *e, *last = NULL;                            \
+        if (__atomic_load_n(&inst->slabs, __ATOMIC_ACQUIRE) <= 1) {             \
+            return UTILS_SUCC;                                                  \
+        }                                                                       \
+        nfree = (unsigned int*)calloc(inst->max_slabs, sizeof(unsigned int));   \
+        RETURN_IF_NULL(nfree, UTILS_ERR_MALLOC);                                \
+        pthread_mutex_lock(&inst->mutex);                                       \
+        /*! detach the whole free list and wait for walkers to leave it */      \
+        old = __atomic_load_n(&inst->head, __ATOMIC_RELAXED);                   \
+        do {                                                                    \
+            neu = LF_TAG_MAKE(LF_TAG_COUNT(old) + 1, LF_ALLOCATOR_NIL);         \
+        } while (!__atomic_compare_exchange_n(&inst->head, &old, neu, true,     \
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));                       \
+        while (__atomic_load_n(&inst->poppers, __ATOMIC_SEQ_CST)) {             \
+            sched_yield();                                                      \
+        }                                                                       \
+        for (idx = LF_TAG_INDEX(old); idx != LF_ALLOCATOR_NIL;                  \
+             idx = LF_ALLOCATOR_AT(inst, idx)->next) {                          \
+            nfree[idx / inst->slab]++;                                          \
+        }                                                                       \
+        for (keep = inst->slabs; keep > 1; keep--) {                            \
+            if (nfree[keep - 1] != inst->slab) break;                           \
+        }                                                                       \
+        /*! relink the elements of the slabs that stay */                       \
+        for (idx = LF_TAG_INDEX(old); idx != LF_ALLOCATOR_NIL; idx = e->next) { \
+            e = LF_ALLOCATOR_AT(inst, idx);                                     \
+            if (idx >= keep * inst->slab) continue;                             \
+            if (last) {                                                         \
+                __atomic_store_n(&last->next, idx, __ATOMIC_RELAXED);           \
+            } else {                                                            \
+                first = idx;                                                    \
+            }                                                                   \
+            last = e;                                                           \
+        }                                                                       \
+        while (inst->slabs > keep) {                                            \
+            __atomic_store_n(&inst->slabs, inst->slabs - 1, __ATOMIC_RELEASE);  \
+            __atomic_store_n(&inst->size, inst->size - inst->slab,              \
+                             __ATOMIC_RELEASE);                                 \
+            free(inst->array[inst->slabs]);                                     \
+            inst->array[inst->slabs] = NULL;                                    \
+        }                                                                       \
+        if (last) {                                                             \
+            PRODUCT##_lfallocator_push(inst, first, last);                      \
+        }                                                                       \
+        pthread_mutex_unlock(&inst->mutex);                                     \
+        free(nfree);                                                            \
+        return UTILS_SUCC;                                                      \
+    }
+
 #ifdef __cplusplus
 };
 #endif /* __cplusplus */
@@ -103,6 +103,173 @@ static inline bool bitmask_test(unsigned int *bitmask, int bit)
     return bitmask[BIT_WORD(bit)] & BIT_MASK(bit);
 }
 
+/*
+ * Hierarchical Bitmap Operations
+ *
+ * The leaf level keeps one bit per entry in 64-bit words. Each level above
+ * keeps two summaries of the level below with one bit per word: `full` marks
+ * words with every bit set and `any` marks words with at least one bit set.
+ * hbitmap_ffz/hbitmap_ffs descend from the single top word and look at one
+ * word per level, so a lookup costs the same for 64 entries and for millions
+ * of entries (HBITMAP_MAX_LEVELS summary levels cover 2^30 bits).
+ *
+ * Like the bitmask operations, this doesn't provide any locking.
+ *
+ * Example:
+ *
+ * struct hbitmap hb;
+ * unsigned long long *mem = malloc(hbitmap_words(n) * sizeof(*mem));
+ * hbitmap_init(&hb, mem, n);
+ * ...
+ * int bit = hbitmap_ffz(&hb);
+ * hbitmap_set(&hb, bit);
+ * ...
+ * hbitmap_clear(&hb, bit);
+ *
+ */
+
+#define HBITMAP_BITS_PER_WORD   64
+#define HBITMAP_MAX_LEVELS      4
+#define HBITS_TO_WORDS(x)       (((x) + HBITMAP_BITS_PER_WORD - 1) / HBITMAP_BITS_PER_WORD)
+#define HBIT_WORD(x)            ((x) / HBITMAP_BITS_PER_WORD)
+#define HBIT_MASK(x)            (1ULL << ((x) % HBITMAP_BITS_PER_WORD))
+
+struct hbitmap {
+    int num_bits;
+    int levels;                                 /* number of summary levels */
+    unsigned long long *leaf;
+    unsigned long long *full[HBITMAP_MAX_LEVELS + 1];
+    unsigned long long *any[HBITMAP_MAX_LEVELS + 1];
+};
+
+/* Number of 64-bit words backing a hierarchical bitmap of num_bits */
+static inline size_t hbitmap_words(int num_bits)
+{
+    size_t n = HBITS_TO_WORDS(num_bits), total = n;
+
+    while (n > 1) {
+        n = HBITS_TO_WORDS(n);
+        total += 2 * n;
+    }
+    return total;
+}
+
+static inline void hbitmap_init(struct hbitmap *hb, unsigned long long *mem,
+                                int num_bits)
+{
+    size_t n = HBITS_TO_WORDS(num_bits), below;
+    int l = 0;
+
+    memset(mem, 0, hbitmap_words(num_bits) * sizeof(unsigned long long));
+    hb->num_bits = num_bits;
+    hb->leaf = mem;
+    mem += n;
+    while (n > 1 && l < HBITMAP_MAX_LEVELS) {
+        below = n;
+        n = HBITS_TO_WORDS(n);
+        l++;
+        hb->full[l] = mem;
+        hb->any[l] = mem + n;
+        mem += 2 * n;
+        /*! words past the level below count as full, so ffz never descends there */
+        if (below % HBITMAP_BITS_PER_WORD)
+            hb->full[l][n - 1] = ~0ULL << (below % HBITMAP_BITS_PER_WORD);
+    }
+    hb->levels = l;
+}
+
+static inline void hbitmap_set(struct hbitmap *hb, int bit)
+{
+    size_t w = HBIT_WORD(bit);
+    unsigned long long old = hb->leaf[w];
+    bool full, any;
+    int l;
+
+    hb->leaf[w] = old | HBIT_MASK(bit);
+    full = hb->leaf[w] == ~0ULL;
+    any = old == 0;
+    for (l = 1; l <= hb->levels && (full || any); l++) {
+        size_t i = w;
+        w = HBIT_WORD(i);
+        if (full) {
+            hb->full[l][w] |= HBIT_MASK(i);
+            full = hb->full[l][w] == ~0ULL;
+        }
+        if (any) {
+            any = hb->any[l][w] == 0;
+            hb->any[l][w] |= HBIT_MASK(i);
+        }
+    }
+}
+
+static inline void hbitmap_clear(struct hbitmap *hb, int bit)
+{
+    size_t w = HBIT_WORD(bit);
+    unsigned long long old = hb->leaf[w];
+    bool full, any;
+    int l;
+
+    hb->leaf[w] = old & ~HBIT_MASK(bit);
+    full = old == ~0ULL;
+    any = hb->leaf[w] == 0;
+    for (l = 1; l <= hb->levels && (full || any); l++) {
+        size_t i = w;
+        w = HBIT_WORD(i);
+        if (full) {
+            full = hb->full[l][w] == ~0ULL;
+            hb->full[l][w] &= ~HBIT_MASK(i);
+        }
+        if (any) {
+            hb->any[l][w] &= ~HBIT_MASK(i);
+            any = hb->any[l][w] == 0;
+        }
+    }
+}
+
+static inline bool hbitmap_test(const struct hbitmap *hb, int bit)
+{
+    return hb->leaf[HBIT_WORD(bit)] & HBIT_MASK(bit);
+}
+
+/* Find first zero bit, -1 if all num_bits are set */
+static inline int hbitmap_ffz(const struct hbitmap *hb)
+{
+    size_t w = 0;
+    unsigned long long word;
+    int l, result;
+
+    for (l = hb->levels; l > 0; l--) {
+        word = hb->full[l][w];
+        if (word == ~0ULL)
+            return -1;
+        w = w * HBITMAP_BITS_PER_WORD + __builtin_ctzll(~word);
+    }
+    word = hb->leaf[w];
+    if (word == ~0ULL)
+        return -1;
+    result = (int)(w * HBITMAP_BITS_PER_WORD) + __builtin_ctzll(~word);
+    return result < hb->num_bits ? result : -1;
+}
+
+/* Find first set bit, -1 if none is set */
+static inline int hbitmap_ffs(const struct hbitmap *hb)
+{
+    size_t w = 0;
+    unsigned long long word;
+    int l;
+
+    for (l = hb->levels; l > 0; l--) {
+        word = hb->any[l][w];
+        if (word == 0)
+            return -1;
+        w = w * HBITMAP_BITS_PER_WORD + __builtin_ctzll(word);
+    }
+    word = hb->leaf[w];
+    if (word == 0)
+        return -1;
+    return (int)(w * HBITMAP_BITS_PER_WORD) + __builtin_ctzll(word);
+}
+
 static inline int popcount(unsigned int x)
 {
     return __builtin_popcount(x);
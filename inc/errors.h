@@ -49,6 +49,9 @@ extern "C" {
 #define    UTILS_ERR_POOL_FULL     (-7)
 #define    UTILS_ERR_POOL_FREE     (-8)
 #define    UTILS_ERR_POOL_ALLOC    (-9)
+#define    UTILS_ERR_TIMEOUT       (-10)
+#define    UTILS_ERR_HUB_CLOSED    (-11)
+#define    UTILS_ERR_RATE_LIMITED  (-12)
 
 #define RETURN_IF_FAIL(ret, code)   \
     do {                            \
@@ -21,6 +21,9 @@
 #ifndef UTILS_EVENT_HUB_C_H
 #define UTILS_EVENT_HUB_C_H
 
+#include <stddef.h>
+#include "thread_attr.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
@@ -34,13 +37,26 @@ typedef unsigned char event_id;
 
 typedef enum {
     EVENT_HUB_MODE_FIFO = 0,
-    EVENT_HUB_MODE_PRIORITY
+    EVENT_HUB_MODE_PRIORITY,
+    EVENT_HUB_MODE_SPSC         /*!< FIFO over a lock-free ring, one sending thread and one worker only */
 } evthub_mode;
 
+typedef enum {
+    EVENT_HUB_ORDER_NONE = 0,   /*!< Workers dispatch events in any order */
+    EVENT_HUB_ORDER_ID          /*!< Events of one id are dispatched in order by one worker */
+} evthub_order;
+
+typedef enum {
+    EVENT_HUB_LIMIT_DROP = 0,   /*!< Discard the event, the send succeeds */
+    EVENT_HUB_LIMIT_REJECT,     /*!< Fail the send with UTILS_ERR_RATE_LIMITED */
+    EVENT_HUB_LIMIT_CONFLATE    /*!< Overwrite the queued event of the same id and priority */
+} evthub_limit_action;
+
 typedef struct {
     unsigned char id;           /*!< Event indentifier */
     unsigned char priority;     /*!< Event priority (for EVENT_HUB_MODE_PRIORITY mode) */
     void *param;                /*!< The parameters that current event carries */
+    unsigned int size;          /*!< Bytes at param stored inline in the hub (evthub_send_data), else 0 */
 } event_t;
 
 /*! \fn void (*on_event_f)(const event_t* event, void* user_data);
@@ -51,11 +67,26 @@ typedef struct {
 */
 typedef void (*on_event_f)(const event_t*, void*);
 
+/*! \fn void (*on_events_f)(const event_t* evts, size_t n, void* user_data);
+    \brief Callback function for batched event notification.
+    \param evts  (I) Contiguous array of pending events in dispatch order.
+    \param n     (I) Number of events in evts.
+    \param user_data  (I) User data held by event_hub.
+    \return none
+*/
+typedef void (*on_events_f)(const event_t*, size_t, void*);
+
 typedef struct {
-    unsigned char max;          /*!< Maximum event allowed in hub */
+    unsigned int max;           /*!< Maximum event allowed in hub, or slab size if ceiling is set */
     evthub_mode mode;           /*!< Event arrangement mode in hub */
     void *user_data;            /*!< User data held by event_hub */
-    on_event_f notifier;        /*!< Callback function for event notification */
+    on_event_f notifier;        /*!< Callback function for every event (optional) */
+    unsigned int ceiling;       /*!< Pool grows by max events up to ceiling when full, and shrinks after 100 ms idle (0: fixed pool) */
+    on_events_f batch_notifier; /*!< Optional callback receiving pending events in batches of up to max */
+    unsigned int workers;       /*!< Number of dispatch threads (0: one) */
+    evthub_order order;         /*!< Ordering between workers when there are several */
+    unsigned int payload;       /*!< Inline payload bytes reserved per event for evthub_send_data */
+    const thread_attr *thread;  /*!< Affinity, scheduling, stack and name of the workers (NULL: defaults) */
 } evthub_parm;
 
 /*! \fn void evthub_create(evthub_t *handle,on_event_f cb)
@@ -74,14 +105,130 @@ int evthub_create(evthub_t *handle, evthub_parm *param);
 */
 int evthub_destory(evthub_t *handle);
 
+/*! \fn int evthub_trace(evthub_t handle, const char *path)
+    \brief Record every accepted event to a binary trace file (see
+           evttrace.h), or stop recording with path NULL. Start and stop
+           while no thread is sending.
+    \param handle (I) Handle of event_hub.
+    \param path   (I) Trace file to create, replacing the current one.
+    \return 0 if success else error code
+*/
+int evthub_trace(const evthub_t handle, const char *path);
+
+/*! \fn int evthub_limit(evthub_t handle, event_id first, event_id last, unsigned int rate, unsigned int burst, evthub_limit_action action)
+    \brief Limit the send rate of each event id in [first, last], checked
+           before an event is allocated or queued. Each id is a token
+           bucket of burst events refilled at rate per second. Events over
+           the limit are handled by action, EVENT_HUB_LIMIT_CONFLATE queues
+           the event when none of its id is pending and drops it in
+           EVENT_HUB_MODE_SPSC.
+    \param handle (I) Handle of event_hub.
+    \param first  (I) First event identifier.
+    \param last   (I) Last event identifier.
+    \param rate   (I) Events per second, 0 removes the limit.
+    \param burst  (I) Events accepted at once, at least 1.
+    \param action (I) What to do with events over the limit.
+    \return 0 if success else error code
+*/
+int evthub_limit(const evthub_t handle, event_id first, event_id last,
+                 unsigned int rate, unsigned int burst, evthub_limit_action action);
+
+/*! \fn int evthub_drain(evthub_t handle, long long timeout_ns, unsigned long long *dispatched, unsigned long long *dropped)
+    \brief Stop accepting events, dispatch the ones still pending and stop
+           the workers. Sends fail with UTILS_ERR_HUB_CLOSED from now on and
+           the handle is only good for evthub_destory afterwards. In
+           EVENT_HUB_MODE_SPSC call it from the sending thread.
+    \param handle     (I) Handle of event_hub.
+    \param timeout_ns (I) Longest time to keep dispatching in nanoseconds,
+                          0 drops everything pending, negative waits until
+                          all pending events are dispatched.
+    \param dispatched (O) Events dispatched while draining (optional).
+    \param dropped    (O) Events discarded at the deadline (optional).
+    \return 0 if every pending event was dispatched, UTILS_ERR_TIMEOUT if
+            some were dropped, else error code
+*/
+int evthub_drain(const evthub_t handle, long long timeout_ns,
+                 unsigned long long *dispatched, unsigned long long *dropped);
+
 /*! \fn void evthub_send(evthub_t *handle,const event_t *evt)
-    \brief Send a event to event_hub.
+    \brief Send a event to event_hub, never blocks.
+           Fails with UTILS_ERR_POOL_ALLOC (UTILS_ERR_POOL_FULL in
+           EVENT_HUB_MODE_SPSC) when the hub has no room for the event, and
+           with UTILS_ERR_RATE_LIMITED when its id is over a rejecting limit.
     \param handle (I) Handle of event_hub.
     \param evt    (I) Pointer of event.
     \return 0 if success else error code
 */
 int evthub_send(const evthub_t handle, const event_t *evt);
 
+/*! \fn int evthub_send_timed(evthub_t handle, const event_t *evt, long long timeout_ns)
+    \brief Send a event to event_hub, waiting for a worker to release room
+           when the hub is full instead of failing at once.
+    \param handle     (I) Handle of event_hub.
+    \param evt        (I) Pointer of event.
+    \param timeout_ns (I) Longest wait in nanoseconds, 0 behaves as evthub_send
+                          and a negative value waits until there is room.
+    \return 0 if success, UTILS_ERR_TIMEOUT if still full at the deadline,
+            UTILS_ERR_HUB_CLOSED if the hub is destroyed while waiting,
+            else error code
+*/
+int evthub_send_timed(const evthub_t handle, const event_t *evt, long long timeout_ns);
+
+/*! \fn int evthub_send_data(evthub_t handle, event_id id, unsigned char priority, const void *buf, size_t len)
+    \brief Send a event whose data is copied into the hub's own event storage.
+           The notified event's param points at the copy and size is len, the
+           copy is valid until the notification returns.
+    \param handle   (I) Handle of event_hub.
+    \param id       (I) Event identifier.
+    \param priority (I) Event priority (for EVENT_HUB_MODE_PRIORITY mode).
+    \param buf      (I) Data carried by the event.
+    \param len      (I) Bytes in buf, at most evthub_parm::payload.
+    \return 0 if success else error code
+*/
+int evthub_send_data(const evthub_t handle, event_id id, unsigned char priority,
+                     const void *buf, size_t len);
+
+/*! \fn int evthub_send_data_timed(evthub_t handle, event_id id, unsigned char priority, const void *buf, size_t len, long long timeout_ns)
+    \brief evthub_send_data waiting for room as evthub_send_timed does.
+    \param handle     (I) Handle of event_hub.
+    \param id         (I) Event identifier.
+    \param priority   (I) Event priority (for EVENT_HUB_MODE_PRIORITY mode).
+    \param buf        (I) Data carried by the event.
+    \param len        (I) Bytes in buf, at most evthub_parm::payload.
+    \param timeout_ns (I) Longest wait in nanoseconds, 0 behaves as evthub_send_data
+                          and a negative value waits until there is room.
+    \return 0 if success, UTILS_ERR_TIMEOUT if still full at the deadline,
+            UTILS_ERR_HUB_CLOSED if the hub is destroyed while waiting,
+            else error code
+*/
+int evthub_send_data_timed(const evthub_t handle, event_id id, unsigned char priority,
+                           const void *buf, size_t len, long long timeout_ns);
+
+/*! \fn int evthub_subscribe(evthub_t handle, event_id first, event_id last, on_event_f cb, void *user_data)
+    \brief Subscribe a callback to the events with identifier in [first, last].
+           Subscribing the same cb and user_data twice has no effect.
+    \param handle (I) Handle of event_hub.
+    \param first  (I) First event identifier of the range.
+    \param last   (I) Last event identifier of the range, first for a single id.
+    \param cb     (I) Callback function for event notification.
+    \param user_data  (I) User data passed to cb.
+    \return 0 if success else error code
+*/
+int evthub_subscribe(const evthub_t handle, event_id first, event_id last,
+                     on_event_f cb, void *user_data);
+
+/*! \fn int evthub_unsubscribe(evthub_t handle, event_id first, event_id last, on_event_f cb, void *user_data)
+    \brief Cancel a subscription made by evthub_subscribe.
+    \param handle (I) Handle of event_hub.
+    \param first  (I) First event identifier of the range.
+    \param last   (I) Last event identifier of the range.
+    \param cb     (I) Subscribed callback function.
+    \param user_data  (I) Subscribed user data.
+    \return 0 if success else error code
+*/
+int evthub_unsubscribe(const evthub_t handle, event_id first, event_id last,
+                       on_event_f cb, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -0,0 +1,134 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTILS_EVTTRACE_H
+#define UTILS_EVTTRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*! Binary event trace written by evthub_trace and EventHub::SetTrace.
+ *  A file is one evttrace_header followed by evttrace_record entries in
+ *  host byte order, records of concurrent producers may interleave out of
+ *  timestamp order.
+ */
+#define EVTTRACE_MAGIC      (0x31525445u)   /*!< "ETR1" */
+#define EVTTRACE_VERSION    (1u)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} evttrace_header;
+
+typedef struct {
+    uint64_t timestamp;         /*!< CLOCK_MONOTONIC nanoseconds at send */
+    uint32_t producer;          /*!< Kernel thread id of the sender */
+    uint32_t id;                /*!< Event identifier */
+    uint32_t size;              /*!< Payload bytes carried by the event */
+    uint8_t priority;           /*!< evthub priority, larger first, EventHub records ToEvthubPriority */
+    uint8_t reserved[3];
+} evttrace_record;
+
+static inline uint64_t evttrace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*! Thread id of the caller, cached so tracing costs no syscall per event */
+static inline uint32_t evttrace_tid(void)
+{
+    static __thread uint32_t tid;
+    if (tid == 0) {
+        tid = (uint32_t)syscall(SYS_gettid);
+    }
+    return tid;
+}
+
+/*! \fn FILE* evttrace_open(const char *path)
+    \brief Create a trace file and write its header.
+    \return the file or NULL on failure
+*/
+static inline FILE* evttrace_open(const char *path)
+{
+    evttrace_header h = { EVTTRACE_MAGIC, EVTTRACE_VERSION };
+    FILE *f = fopen(path, "wb");
+    if (f && fwrite(&h, sizeof(h), 1, f) != 1) {
+        fclose(f);
+        f = NULL;
+    }
+    return f;
+}
+
+/*! \fn int evttrace_write(FILE *f, uint32_t id, uint8_t priority, uint32_t size)
+    \brief Append a record stamped now by the calling thread, one fwrite
+           keeps records of concurrent producers whole.
+    \return 0 if success else -1
+*/
+static inline int evttrace_write(FILE *f, uint32_t id, uint8_t priority, uint32_t size)
+{
+    evttrace_record r;
+    memset(&r, 0, sizeof(r));
+    r.timestamp = evttrace_now();
+    r.producer = evttrace_tid();
+    r.id = id;
+    r.size = size;
+    r.priority = priority;
+    return fwrite(&r, sizeof(r), 1, f) == 1 ? 0 : -1;
+}
+
+/*! \fn FILE* evttrace_load(const char *path)
+    \brief Open a trace file for evttrace_read after checking its header.
+    \return the file or NULL if missing or not a trace
+*/
+static inline FILE* evttrace_load(const char *path)
+{
+    evttrace_header h;
+    FILE *f = fopen(path, "rb");
+    if (f && (fread(&h, sizeof(h), 1, f) != 1 || h.magic != EVTTRACE_MAGIC
+              || h.version != EVTTRACE_VERSION)) {
+        fclose(f);
+        f = NULL;
+    }
+    return f;
+}
+
+/*! \fn int evttrace_read(FILE *f, evttrace_record *r)
+    \return 1 if a record was read, 0 at the end of the trace
+*/
+static inline int evttrace_read(FILE *f, evttrace_record *r)
+{
+    return fread(r, sizeof(*r), 1, f) == 1;
+}
+
+#ifdef __cplusplus
+};
+#endif /* __cplusplus */
+
+#endif /*!< UTILS_EVTTRACE_H */
@@ -0,0 +1,55 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTILS_PROBES_H
+#define UTILS_PROBES_H
+
+/*! USDT probes on the hub hot paths, built in with the USDT cmake option.
+ *  Providers are evthub (C) and eventhub (C++), every probe carries three
+ *  integer arguments:
+ *
+ *    enqueue         id, priority, queue depth after the push
+ *    reject          id, priority, reason, one of EVTHUB_REJECT_*
+ *    dequeue         id, priority, queue depth left when it was taken
+ *    handler_entry   id, priority, handler address
+ *    handler_exit    id, priority, handler address
+ *    park            worker index, 0, queue depth
+ *    unpark          worker index, 0, queue depth
+ *
+ *  e.g. bpftrace -e 'usdt:./libevthub.so:evthub:enqueue { @[arg0] = count(); }'
+ *
+ *  An unattached probe is a single nop. Without USDT the arguments are not
+ *  even evaluated.
+ */
+/*! Reasons of the reject probe, the same in both providers */
+#define EVTHUB_REJECT_FULL      (1)     /*!< no room in the queue or pool */
+#define EVTHUB_REJECT_CLOSED    (2)     /*!< hub draining or destroyed */
+#define EVTHUB_REJECT_LIMITED   (3)     /*!< over a rate limit, whatever its action */
+#define EVTHUB_REJECT_BYTES     (4)     /*!< over the byte budget (C++ only) */
+
+#ifdef EVTHUB_USDT
+#include <sys/sdt.h>
+#define EVTHUB_PROBE(provider, name, a, b, c) \
+    DTRACE_PROBE3(provider, name, a, b, c)
+#else
+#define EVTHUB_PROBE(provider, name, a, b, c) do { } while (0)
+#endif
+
+#endif /*!< UTILS_PROBES_H */
@@ -0,0 +1,118 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef UTILS_THREAD_ATTR_H
+#define UTILS_THREAD_ATTR_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "errors.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+typedef struct {
+    const char *name;           /*!< Name shown by top and perf, 15 chars at most (NULL: inherited) */
+    unsigned long long cpus;    /*!< CPUs to run on, bit n for CPU n (0: any) */
+    int policy;                 /*!< SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+    int priority;               /*!< Static priority for SCHED_FIFO and SCHED_RR */
+    size_t stack;               /*!< Stack size in bytes (0: default) */
+} thread_attr;
+
+/*! thread_spawn uses the GNU pthread extensions, C sources calling it
+ *  define _GNU_SOURCE before their first include */
+#ifdef _GNU_SOURCE
+
+/*! \fn int thread_spawn(pthread_t *tid, const thread_attr *attr, int index, void *(*routine)(void*), void *arg)
+    \brief Create a thread with attr applied before it runs. Realtime
+           policies usually need CAP_SYS_NICE.
+    \param tid     (O) Thread created.
+    \param attr    (I) Thread attributes, NULL for defaults.
+    \param index   (I) Appended to the name of threads sharing attr, negative for none.
+    \param routine (I) Thread routine.
+    \param arg     (I) Argument of routine.
+    \return 0 if success, UTILS_ERR_PARAM if attr is invalid, else UTILS_ERR_THREAD
+*/
+static inline int thread_spawn(pthread_t *tid, const thread_attr *attr, int index,
+                               void *(*routine)(void*), void *arg)
+{
+    int i, s;
+    char name[32];
+    cpu_set_t set;
+    pthread_attr_t pa;
+    struct sched_param sp;
+
+    if (!attr) {
+        return pthread_create(tid, NULL, routine, arg) ? UTILS_ERR_THREAD : UTILS_SUCC;
+    }
+    if (pthread_attr_init(&pa)) {
+        return UTILS_ERR_THREAD;
+    }
+    s = UTILS_SUCC;
+    if (attr->stack && pthread_attr_setstacksize(&pa, attr->stack)) {
+        s = UTILS_ERR_PARAM;
+    }
+    if (s == UTILS_SUCC && attr->cpus) {
+        CPU_ZERO(&set);
+        for (i = 0; i < 64; i++) {
+            if (attr->cpus & (1ULL << i)) {
+                CPU_SET(i, &set);
+            }
+        }
+        if (pthread_attr_setaffinity_np(&pa, sizeof(set), &set)) {
+            s = UTILS_ERR_PARAM;
+        }
+    }
+    if (s == UTILS_SUCC && attr->policy != SCHED_OTHER) {
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = attr->priority;
+        if (pthread_attr_setinheritsched(&pa, PTHREAD_EXPLICIT_SCHED)
+            || pthread_attr_setschedpolicy(&pa, attr->policy)
+            || pthread_attr_setschedparam(&pa, &sp)) {
+            s = UTILS_ERR_PARAM;
+        }
+    }
+    if (s == UTILS_SUCC && pthread_create(tid, &pa, routine, arg)) {
+        s = UTILS_ERR_THREAD;
+    }
+    pthread_attr_destroy(&pa);
+    if (s == UTILS_SUCC && attr->name) {
+        if (index < 0) {
+            snprintf(name, sizeof(name), "%s", attr->name);
+        } else {
+            snprintf(name, sizeof(name), "%.11s-%d", attr->name, index);
+        }
+        name[15] = '\0'; /*!< kernel limit */
+        pthread_setname_np(*tid, name); /*!< cosmetic, failure is ignored */
+    }
+    return s;
+}
+
+#endif /* _GNU_SOURCE */
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /*!< UTILS_THREAD_ATTR_H */
@@ -0,0 +1,1182 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include "EventHub.h"
+#include "HubRegistry.h"
+#include "Pipeline.h"
+#include "Bridge.h"
+#include "evttrace.h"
+
+using namespace utils;
+
+namespace {
+
+class TestEvent : public Event
+{
+  public:
+    TestEvent(uint32_t id, EvtPriority pri) : id_(id), pri_(pri) {}
+    virtual ~TestEvent() {}
+
+    virtual uint32_t ID() const { return id_; }
+    virtual const char* Name() const { return "test"; }
+    virtual EvtPriority Priority() const { return pri_; }
+
+  private:
+    uint32_t id_;
+    EvtPriority pri_;
+};
+
+class CountHandler : public EventHandler
+{
+  public:
+    explicit CountHandler(int delay_us = 0) : count_(0), delay_us_(delay_us) {}
+    virtual ~CountHandler() {}
+    virtual void OnEvent(const SpEvent evt)
+    {
+        if (delay_us_) usleep(delay_us_);
+        if (evt != nullptr) count_++;
+    }
+    std::atomic<int> count_;
+
+  private:
+    int delay_us_;
+};
+
+SpEvent MakeEvent(uint32_t id)
+{
+    return SpEvent(new TestEvent(id, EvtPriority::kEvtPriMid));
+}
+
+}
+
+TEST(EventHub, Drain)
+{
+    CountHandler handler;
+    EventHub hub(&handler, 16);
+    for (uint32_t i = 0; i < 10; ++i) {
+        EXPECT_TRUE(hub.Send(MakeEvent(i)));
+    }
+    DrainResult r = hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(r.dispatched, 10u);
+    EXPECT_EQ(r.dropped, 0u);
+    EXPECT_EQ(handler.count_.load(), 10);
+    EXPECT_FALSE(hub.Send(MakeEvent(0)));
+}
+
+TEST(EventHub, DrainDeadline)
+{
+    CountHandler handler(20000);
+    EventHub hub(&handler, 32);
+    for (uint32_t i = 0; i < 20; ++i) {
+        EXPECT_TRUE(hub.Send(MakeEvent(i)));
+    }
+    DrainResult r = hub.Drain(std::chrono::steady_clock::now() + std::chrono::milliseconds(30));
+    EXPECT_GT(r.dropped, 0u);
+    EXPECT_EQ(r.dispatched + r.dropped, 20u);
+    EXPECT_EQ((size_t)handler.count_.load(), r.dispatched);
+}
+
+TEST(HubRegistry, Get)
+{
+    HubRegistry &registry = HubRegistry::GetInstance();
+    EXPECT_EQ(registry.Find("registry.a"), nullptr);
+
+    EventHub *hubs[4] = {};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&, i]() { hubs[i] = &registry.Get("registry.a", 8); });
+    }
+    for (auto &t : threads) t.join();
+    for (int i = 1; i < 4; ++i) {
+        EXPECT_EQ(hubs[i], hubs[0]);
+    }
+    EXPECT_EQ(registry.Find("registry.a"), hubs[0]);
+    EXPECT_NE(&registry.Get("registry.b", 8), hubs[0]);
+
+    /*! the thread starts on the first send */
+    CountHandler handler;
+    EventHub &hub = registry.Get("registry.a", 8);
+    EXPECT_TRUE(hub.Subscribe(&handler));
+    EXPECT_TRUE(hub.Send(MakeEvent(1)));
+    for (int i = 0; i < 1000 && handler.count_.load() < 1; ++i) {
+        hub.Signal();
+        usleep(1000);
+    }
+    EXPECT_EQ(handler.count_.load(), 1);
+    EXPECT_TRUE(hub.UnSubscribe(&handler));
+}
+
+namespace {
+
+class TrackedEvent : public TestEvent
+{
+  public:
+    TrackedEvent(uint32_t id, EvtPriority pri, std::atomic<int> &alive)
+      : TestEvent(id, pri), alive_(alive) { alive_++; }
+    virtual ~TrackedEvent() { alive_--; }
+
+  private:
+    std::atomic<int> &alive_;
+};
+
+/*! Records ids, from the SpEvent or the const Event& interface */
+class OrderHandler : public EventHandler
+{
+  public:
+    OrderHandler() : shared_(0), unique_(0) {}
+    virtual ~OrderHandler() {}
+    virtual void OnEvent(const SpEvent evt)
+    {
+        ids_.push_back(evt->ID());
+        shared_++;
+    }
+    virtual void OnEvent(const Event &evt)
+    {
+        ids_.push_back(evt.ID());
+        unique_++;
+    }
+    std::vector<uint32_t> ids_;
+    int shared_;
+    int unique_;
+};
+
+}
+
+TEST(EventHub, SendUnique)
+{
+    std::atomic<int> alive(0);
+    OrderHandler order;
+    CountHandler count; // only knows SpEvent, gets an owning one
+    EventHub hub(4);
+
+    /*! let the thread start and go idle, sends do not wake it in tests */
+    EXPECT_TRUE(hub.Send(MakeEvent(0)));
+    usleep(10000);
+    hub.Subscribe(&order);
+    hub.Subscribe(&count);
+
+    EXPECT_TRUE(hub.Send(UpEvent(new TrackedEvent(1, EvtPriority::kEvtPriLow, alive))));
+    EXPECT_TRUE(hub.Send(MakeEvent(2)));
+    EXPECT_TRUE(hub.Send(UpEvent(new TrackedEvent(3, EvtPriority::kEvtPriHigh, alive))));
+    EXPECT_TRUE(hub.Send(UpEvent(new TrackedEvent(4, EvtPriority::kEvtPriHigh, alive))));
+
+    /*! a rejected event stays with the caller */
+    UpEvent full(new TrackedEvent(5, EvtPriority::kEvtPriHigh, alive));
+    EXPECT_FALSE(hub.Send(std::move(full)));
+    ASSERT_NE(full, nullptr);
+    EXPECT_EQ(full->ID(), 5u);
+    full.reset();
+    EXPECT_EQ(alive.load(), 3);
+
+    DrainResult r = hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(r.dispatched, 4u);
+    EXPECT_EQ(order.ids_, std::vector<uint32_t>({ 3, 4, 2, 1 }));
+    EXPECT_EQ(order.unique_, 3);
+    EXPECT_EQ(order.shared_, 1);
+    EXPECT_EQ(count.count_.load(), 4);
+    EXPECT_EQ(alive.load(), 0);
+}
+
+namespace {
+
+/*! Keeps every event, only knows SpEvent */
+class KeepHandler : public EventHandler
+{
+  public:
+    virtual void OnEvent(const SpEvent evt) { kept_.push_back(evt); }
+    std::vector<SpEvent> kept_;
+};
+
+}
+
+TEST(EventHub, ShareUnique)
+{
+    std::atomic<int> alive(0);
+    KeepHandler keep;
+    OrderHandler order;
+    EventHub hub(4), next(4);
+    hub.Subscribe(&keep);
+    hub.Subscribe(&order);
+    EXPECT_TRUE(hub.Send(UpEvent(new TrackedEvent(1, EvtPriority::kEvtPriMid, alive))));
+    EXPECT_TRUE(hub.Send(UpEvent(new TrackedEvent(2, EvtPriority::kEvtPriMid, alive))));
+    hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+
+    /*! kept events outlive the dispatch, Event& handlers are unaffected */
+    EXPECT_EQ(order.unique_, 2);
+    ASSERT_EQ(keep.kept_.size(), 2u);
+    EXPECT_EQ(alive.load(), 2);
+    EXPECT_EQ(keep.kept_[1]->ID(), 2u);
+    EXPECT_TRUE(next.Send(keep.kept_[0]));
+    keep.kept_.clear();
+    EXPECT_EQ(alive.load(), 1);
+    next.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(alive.load(), 0);
+}
+
+TEST(EventHub, Watermarks)
+{
+    CountHandler handler;
+    EventHub hub(8);
+    std::vector<size_t> highs, lows;
+    EXPECT_FALSE(hub.SetWatermarks(4, 4, [](size_t) {}, [](size_t) {}));
+    EXPECT_TRUE(hub.SetWatermarks(4, 1,
+        [&](size_t depth) { highs.push_back(depth); },
+        [&](size_t depth) { lows.push_back(depth); }));
+
+    /*! let the thread start and go idle, sends do not wake it in tests */
+    EXPECT_TRUE(hub.Send(MakeEvent(0)));
+    usleep(10000);
+    hub.Subscribe(&handler);
+    for (uint32_t i = 0; i < 6; ++i) {
+        EXPECT_TRUE(hub.Send(MakeEvent(i)));
+    }
+    EXPECT_EQ(highs, std::vector<size_t>({ 4 }));
+    for (int i = 0; i < 1000 && handler.count_.load() < 6; ++i) {
+        hub.Signal();
+        usleep(1000);
+    }
+    EXPECT_EQ(lows, std::vector<size_t>({ 1 }));
+
+    HubStats stats = hub.GetStats();
+    EXPECT_EQ(stats.sent, 7u);
+    EXPECT_EQ(stats.dispatched, 7u);
+    EXPECT_EQ(stats.high_marks, 1u);
+    EXPECT_EQ(stats.low_marks, 1u);
+    EXPECT_EQ(stats.peak_depth, 6u);
+    EXPECT_EQ(stats.depth, 0u);
+}
+
+TEST(EventHub, WatermarkOrder)
+{
+    CountHandler handler;
+    EventHub hub(8);
+    std::vector<std::string> marks;
+    EXPECT_TRUE(hub.SetWatermarks(2, 0,
+        [&](size_t) {
+            /*! the hub falls below low while on_high still runs */
+            for (int i = 0; i < 1000 && handler.count_.load() < 2; ++i) {
+                hub.Signal();
+                usleep(1000);
+            }
+            marks.push_back("high");
+        },
+        [&](size_t) { marks.push_back("low"); }));
+
+    /*! let the thread start and go idle, sends do not wake it in tests */
+    EXPECT_TRUE(hub.Send(MakeEvent(0)));
+    usleep(10000);
+    hub.Subscribe(&handler);
+    EXPECT_TRUE(hub.Send(MakeEvent(1)));
+    EXPECT_TRUE(hub.Send(MakeEvent(2)));
+    EXPECT_EQ(handler.count_.load(), 2);
+    EXPECT_EQ(marks, std::vector<std::string>({ "high", "low" }));
+}
+
+TEST(EventHub, Adaptive)
+{
+    CountHandler handler;
+    EventHub hub(&handler, 4);
+    EXPECT_FALSE(hub.SetAdaptive(8, 4, 2));
+    EXPECT_TRUE(hub.SetAdaptive(4, 10, 4));
+
+    EXPECT_TRUE(hub.Send(MakeEvent(0)));
+    for (int i = 0; i < 1000 && handler.count_.load() < 1; ++i) {
+        hub.Signal();
+        usleep(1000);
+    }
+    usleep(10000);
+
+    /*! grows 4 -> 8 -> 10, then stays full */
+    for (uint32_t i = 0; i < 10; ++i) {
+        EXPECT_TRUE(hub.Send(MakeEvent(i)));
+    }
+    EXPECT_FALSE(hub.Send(MakeEvent(10)));
+    HubStats stats = hub.GetStats();
+    EXPECT_EQ(stats.capacity, 10u);
+    EXPECT_EQ(stats.grows, 2u);
+    EXPECT_EQ(stats.rejected, 1u);
+
+    /*! a burst right after the queue emptied finds the grown capacity */
+    for (int i = 0; i < 1000 && handler.count_.load() < 11; ++i) {
+        hub.Signal();
+        usleep(1000);
+    }
+    for (uint32_t i = 0; i < 6; ++i) {
+        EXPECT_TRUE(hub.Send(MakeEvent(i)));
+    }
+    stats = hub.GetStats();
+    EXPECT_EQ(stats.grows, 2u);
+    EXPECT_EQ(stats.shrinks, 0u);
+
+    /*! back to the soft limit once it stayed empty */
+    for (int i = 0; i < 1000 && handler.count_.load() < 17; ++i) {
+        hub.Signal();
+        usleep(1000);
+    }
+    for (int i = 0; i < 1000 && hub.GetStats().shrinks == 0; ++i) {
+        usleep(1000);
+    }
+    stats = hub.GetStats();
+    EXPECT_EQ(stats.capacity, 4u);
+    EXPECT_EQ(stats.shrinks, 1u);
+}
+
+namespace {
+
+/*! Slow handler appending to a log shared with the done callback */
+class LogHandler : public EventHandler
+{
+  public:
+    LogHandler(std::mutex &mutex, std::vector<std::string> &log)
+      : mutex_(mutex), log_(log) {}
+    virtual ~LogHandler() {}
+    virtual void OnEvent(const SpEvent evt) { OnEvent(*evt); }
+    virtual void OnEvent(const Event &evt)
+    {
+        usleep(50000);
+        std::lock_guard<std::mutex> l(mutex_);
+        log_.push_back("handled " + std::to_string(evt.ID()));
+    }
+
+  private:
+    std::mutex &mutex_;
+    std::vector<std::string> &log_;
+};
+
+}
+
+TEST(EventHub, FanOutOrdered)
+{
+    std::mutex mutex;
+    std::vector<std::string> log;
+    std::vector<std::unique_ptr<LogHandler>> handlers;
+    EventHub hub(8);
+    EXPECT_FALSE(hub.SetFanOut(0, true));
+    EXPECT_TRUE(hub.SetFanOut(3, true, [&](const Event &evt) {
+        std::lock_guard<std::mutex> l(mutex);
+        log.push_back("done " + std::to_string(evt.ID()));
+    }));
+    for (int i = 0; i < 4; ++i) {
+        handlers.emplace_back(new LogHandler(mutex, log));
+        hub.Subscribe(handlers.back().get());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(hub.Send(UpEvent(new TestEvent(1, EvtPriority::kEvtPriMid))));
+    EXPECT_TRUE(hub.Send(MakeEvent(2)));
+    DrainResult r = hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(r.dispatched + r.dropped, 2u);
+
+    /*! handlers of one event overlap, events do not */
+    EXPECT_LT(elapsed, std::chrono::milliseconds(350));
+    std::vector<std::string> expect;
+    for (uint32_t id = 1; id <= 2; ++id) {
+        for (int i = 0; i < 4; ++i) {
+            expect.push_back("handled " + std::to_string(id));
+        }
+        expect.push_back("done " + std::to_string(id));
+    }
+    std::lock_guard<std::mutex> l(mutex);
+    EXPECT_EQ(log, expect);
+}
+
+TEST(EventHub, FanOutUnordered)
+{
+    std::mutex mutex;
+    std::vector<std::string> log;
+    std::atomic<int> done(0);
+    std::vector<std::unique_ptr<LogHandler>> handlers;
+    {
+        EventHub hub(8);
+        EXPECT_TRUE(hub.SetFanOut(2, false, [&](const Event&) { done++; }));
+        for (int i = 0; i < 3; ++i) {
+            handlers.emplace_back(new LogHandler(mutex, log));
+            hub.Subscribe(handlers.back().get());
+        }
+        for (uint32_t id = 0; id < 3; ++id) {
+            EXPECT_TRUE(hub.Send(MakeEvent(id)));
+        }
+        hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    }
+    /*! the pool finishes queued handlers before the hub goes away */
+    EXPECT_EQ(done.load(), 3);
+    EXPECT_EQ(log.size(), 9u);
+}
+
+TEST(EventHub, SetTrace)
+{
+    const char *path = "eventhub_trace_test.bin";
+    {
+        EventHub hub(8);
+        EXPECT_TRUE(hub.SetTrace(path));
+        EXPECT_TRUE(hub.Send(MakeEvent(3)));
+        EXPECT_TRUE(hub.Send(UpEvent(new TestEvent(4, EvtPriority::kEvtPriHigh))));
+    }
+    FILE *f = evttrace_load(path);
+    ASSERT_NE(f, nullptr);
+    evttrace_record r[3];
+    EXPECT_EQ(evttrace_read(f, &r[0]), 1);
+    EXPECT_EQ(evttrace_read(f, &r[1]), 1);
+    EXPECT_EQ(evttrace_read(f, &r[2]), 0);
+    fclose(f);
+    unlink(path);
+    EXPECT_EQ(r[0].id, 3u);
+    EXPECT_EQ(r[0].priority, ToEvthubPriority(EvtPriority::kEvtPriMid));
+    EXPECT_EQ(r[1].id, 4u);
+    EXPECT_EQ(r[1].priority, ToEvthubPriority(EvtPriority::kEvtPriHigh));
+}
+
+TEST(EventHub, Watchdog)
+{
+    std::mutex mutex;
+    std::vector<SlowCall> calls;
+    CountHandler slow(30000), fast;
+    EventHub hub(8);
+    EXPECT_FALSE(hub.SetWatchdog(std::chrono::microseconds(0)));
+    EXPECT_TRUE(hub.SetWatchdog(std::chrono::milliseconds(5), [&](const SlowCall &call) {
+        std::lock_guard<std::mutex> l(mutex);
+        calls.push_back(call);
+    }));
+    hub.Subscribe(&slow);
+    hub.Subscribe(&fast);
+    EXPECT_TRUE(hub.SetBudget(&fast, std::chrono::seconds(1)));
+    EXPECT_FALSE(hub.SetBudget(nullptr, std::chrono::seconds(1)));
+
+    EXPECT_TRUE(hub.Send(MakeEvent(7)));
+    EXPECT_TRUE(hub.Send(MakeEvent(8)));
+    hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(hub.SlowCalls(&slow), 2u);
+    EXPECT_EQ(hub.SlowCalls(&fast), 0u);
+    HubStats stats = hub.GetStats();
+    EXPECT_EQ(stats.slow_calls, 2u);
+    EXPECT_EQ(stats.isolated, 0u);
+
+    /*! each slow call is reported once, by the watchdog while it runs */
+    std::lock_guard<std::mutex> l(mutex);
+    ASSERT_EQ(calls.size(), 2u);
+    EXPECT_EQ(calls[0].handler, &slow);
+    EXPECT_EQ(calls[0].id, 7u);
+    EXPECT_TRUE(calls[0].running);
+    EXPECT_GT(calls[0].elapsed, std::chrono::milliseconds(5));
+    EXPECT_EQ(calls[1].id, 8u);
+    EXPECT_EQ(stats.stalls, 2u);
+}
+
+TEST(EventHub, WatchdogIsolate)
+{
+    std::atomic<int> isolated(0);
+    CountHandler slow(20000), fast;
+    EventHub hub(8);
+    EXPECT_TRUE(hub.SetWatchdog(std::chrono::milliseconds(5), [&](const SlowCall &call) {
+        if (call.isolated) isolated++;
+    }, 2));
+    hub.Subscribe(&slow);
+    hub.Subscribe(&fast);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t id = 0; id < 6; ++id) {
+        EXPECT_TRUE(hub.Send(UpEvent(new TestEvent(id, EvtPriority::kEvtPriMid))));
+    }
+    hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    /*! the fast handler stops waiting on the slow one after two calls */
+    EXPECT_EQ(fast.count_.load(), 6);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(100));
+    EXPECT_EQ(isolated.load(), 1);
+    EXPECT_EQ(hub.GetStats().isolated, 1u);
+
+    /*! the isolated hub still delivers every event */
+    for (int i = 0; i < 100 && slow.count_.load() < 6; ++i) {
+        usleep(10000);
+    }
+    EXPECT_EQ(slow.count_.load(), 6);
+    EXPECT_TRUE(hub.UnSubscribe(&slow));
+}
+
+TEST(Pipeline, Stages)
+{
+    std::atomic<int> sum(0);
+    Pipeline pipeline(8, 4);
+    EXPECT_FALSE(pipeline.Start());
+    EXPECT_TRUE(pipeline.AddStage("decode", [](SpEvent evt) {
+        return evt->ID() % 2 ? evt : nullptr;
+    }));
+    EXPECT_TRUE(pipeline.AddStage("enrich", [](SpEvent evt) {
+        return MakeEvent(evt->ID() * 10);
+    }, 3));
+    EXPECT_TRUE(pipeline.AddStage("route", [&](SpEvent evt) {
+        sum += evt->ID();
+        return nullptr;
+    }));
+    EXPECT_FALSE(pipeline.Send(MakeEvent(1)));
+    EXPECT_TRUE(pipeline.Start());
+    EXPECT_FALSE(pipeline.AddStage("late", [](SpEvent evt) { return evt; }));
+
+    int expect = 0;
+    for (uint32_t id = 0; id < 1000; ++id) {
+        EXPECT_TRUE(pipeline.Send(MakeEvent(id)));
+        expect += id % 2 ? id * 10 : 0;
+    }
+    pipeline.Stop();
+    EXPECT_FALSE(pipeline.Send(MakeEvent(1)));
+    EXPECT_EQ(sum.load(), expect);
+
+    auto stats = pipeline.GetStats();
+    ASSERT_EQ(stats.size(), 3u);
+    EXPECT_EQ(stats[0].name, "decode");
+    EXPECT_EQ(stats[0].processed, 1000u);
+    EXPECT_EQ(stats[0].filtered, 500u);
+    EXPECT_EQ(stats[1].workers, 3u);
+    EXPECT_EQ(stats[1].processed, 500u);
+    EXPECT_EQ(stats[2].processed, 500u);
+    EXPECT_EQ(stats[2].occupancy, 0u);
+    EXPECT_EQ(stats[2].capacity, 8u);
+}
+
+TEST(Pipeline, Backpressure)
+{
+    std::vector<uint32_t> ids;
+    Pipeline pipeline(4, 2);
+    pipeline.AddStage("fast", [](SpEvent evt) { return evt; });
+    pipeline.AddStage("slow", [&](SpEvent evt) {
+        usleep(1000);
+        ids.push_back(evt->ID());
+        return nullptr;
+    });
+    pipeline.Start();
+    for (uint32_t id = 0; id < 50; ++id) {
+        EXPECT_TRUE(pipeline.Send(MakeEvent(id)));
+    }
+    /*! the slow stage holds back the fast one, nothing is lost */
+    auto stats = pipeline.GetStats();
+    EXPECT_GT(stats[0].stalls, 0u);
+    EXPECT_GT(stats[1].busy, stats[0].busy);
+    pipeline.Stop();
+    ASSERT_EQ(ids.size(), 50u);
+    for (uint32_t id = 0; id < 50; ++id) {
+        EXPECT_EQ(ids[id], id);
+    }
+}
+
+namespace {
+
+class SizedEvent : public TestEvent
+{
+  public:
+    SizedEvent(uint32_t id, size_t bytes)
+      : TestEvent(id, EvtPriority::kEvtPriMid), bytes_(bytes) {}
+    virtual size_t Footprint() const { return bytes_; }
+
+  private:
+    size_t bytes_;
+};
+
+}
+
+TEST(EventHub, ByteBudget)
+{
+    const char *path = "eventhub_bytes_test.bin";
+    CountHandler count;
+    EventHub hub(100);
+    hub.SetByteBudget(1000);
+    EXPECT_TRUE(hub.SetTrace(path));
+
+    /*! let the thread start and go idle, sends do not wake it in tests */
+    EXPECT_TRUE(hub.Send(MakeEvent(0)));
+    usleep(10000);
+    hub.Subscribe(&count);
+
+    EXPECT_TRUE(hub.Send(SpEvent(new SizedEvent(1, 400))));
+    EXPECT_TRUE(hub.Send(UpEvent(new SizedEvent(2, 400))));
+    /*! a large event is refused where a small one still fits */
+    EXPECT_FALSE(hub.Send(SpEvent(new SizedEvent(3, 400))));
+    EXPECT_TRUE(hub.Send(SpEvent(new SizedEvent(4, 200))));
+    EXPECT_FALSE(hub.Send(SpEvent(new SizedEvent(5, 1))));
+    HubStats stats = hub.GetStats();
+    EXPECT_EQ(stats.bytes, 1000u);
+    EXPECT_EQ(stats.peak_bytes, 1000u);
+    EXPECT_EQ(stats.byte_budget, 1000u);
+    EXPECT_EQ(stats.rejected, 2u);
+
+    DrainResult r = hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(r.dispatched, 3u);
+    EXPECT_EQ(count.count_.load(), 3);
+    stats = hub.GetStats();
+    EXPECT_EQ(stats.bytes, 0u);
+    EXPECT_EQ(stats.peak_bytes, 1000u);
+    hub.SetTrace(nullptr);
+
+    /*! the trace records the footprint */
+    FILE *f = evttrace_load(path);
+    ASSERT_NE(f, nullptr);
+    evttrace_record rec;
+    std::vector<uint32_t> sizes;
+    while (evttrace_read(f, &rec) == 1) {
+        sizes.push_back(rec.size);
+    }
+    fclose(f);
+    unlink(path);
+    EXPECT_EQ(sizes, std::vector<uint32_t>({ 0, 400, 400, 200 }));
+}
+
+TEST(EventHub, FanOutHoldsRoom)
+{
+    std::mutex mutex;
+    std::vector<std::string> log;
+    std::vector<std::unique_ptr<LogHandler>> handlers;
+    EventHub hub(2);
+    EXPECT_TRUE(hub.SetFanOut(1, false));
+    for (int i = 0; i < 2; ++i) {
+        handlers.emplace_back(new LogHandler(mutex, log));
+        hub.Subscribe(handlers.back().get());
+    }
+    EXPECT_TRUE(hub.Send(SpEvent(new SizedEvent(1, 100))));
+    EXPECT_TRUE(hub.Send(SpEvent(new SizedEvent(2, 100))));
+    for (int i = 0; i < 1000 && hub.GetStats().dispatched == 0; ++i) {
+        hub.Signal();
+        usleep(1000);
+    }
+
+    /*! the event whose handlers still run keeps its room and bytes */
+    EXPECT_FALSE(hub.Send(SpEvent(new SizedEvent(3, 100))));
+    EXPECT_EQ(hub.GetStats().bytes, 200u);
+    DrainResult r = hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(r.dropped, 0u);
+    EXPECT_EQ(hub.GetStats().bytes, 0u);
+    std::lock_guard<std::mutex> l(mutex);
+    EXPECT_EQ(log.size(), 4u);
+}
+
+TEST(EventHub, SendUntil)
+{
+    CountHandler count;
+    EventHub hub(1);
+    hub.SetByteBudget(1000);
+    EXPECT_TRUE(hub.SetLimit(10, 10, 1, 1, LimitAction::kReject));
+    auto soon = [] { return std::chrono::steady_clock::now() + std::chrono::milliseconds(20); };
+
+    /*! let the thread start and go idle, sends do not wake it in tests */
+    EXPECT_TRUE(hub.Send(MakeEvent(0)));
+    usleep(10000);
+    hub.Subscribe(&count);
+
+    /*! refusals that waiting cannot cure return at once */
+    EXPECT_EQ(hub.SendUntil(SpEvent(new SizedEvent(1, 2000)), soon()), SendStatus::kRefused);
+    EXPECT_EQ(hub.SendUntil(MakeEvent(10), soon()), SendStatus::kSent);
+    EXPECT_EQ(hub.SendUntil(MakeEvent(10), soon()), SendStatus::kRefused);
+    EXPECT_EQ(hub.SendUntil(MakeEvent(2), soon()), SendStatus::kFull);
+
+    /*! a waiter goes on once the dispatch releases room */
+    SendStatus s = SendStatus::kFull;
+    std::thread sender([&] {
+        s = hub.SendUntil(MakeEvent(3), std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    });
+    usleep(10000);
+    hub.Signal();
+    sender.join();
+    EXPECT_EQ(s, SendStatus::kSent);
+
+    hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(count.count_.load(), 2);
+    EXPECT_EQ(hub.SendUntil(MakeEvent(4), soon()), SendStatus::kClosed);
+}
+
+TEST(EventHub, SetLimit)
+{
+    CountHandler count;
+    EventHub hub(100);
+    EXPECT_FALSE(hub.SetLimit(2, 1, 1, 1, LimitAction::kDrop));
+    EXPECT_FALSE(hub.SetLimit(1, 2, 1, 0, LimitAction::kDrop));
+    EXPECT_TRUE(hub.SetLimit(10, 19, 1, 2, LimitAction::kReject));
+    EXPECT_TRUE(hub.SetLimit(20, 20, 1, 1, LimitAction::kDrop));
+    EXPECT_TRUE(hub.SetLimit(30, 30, 1, 1, LimitAction::kConflate));
+    EXPECT_FALSE(hub.SetLimit(15, 25, 1, 1, LimitAction::kDrop));
+    hub.SetByteBudget(4);
+
+    /*! let the thread start and go idle, sends do not wake it in tests */
+    EXPECT_TRUE(hub.Send(MakeEvent(0)));
+    usleep(10000);
+    hub.Subscribe(&count);
+
+    /*! ids of a range share the bucket */
+    EXPECT_TRUE(hub.Send(MakeEvent(10)));
+    EXPECT_TRUE(hub.Send(UpEvent(new TestEvent(11, EvtPriority::kEvtPriMid))));
+    EXPECT_FALSE(hub.Send(MakeEvent(12)));
+    UpEvent up(new TestEvent(13, EvtPriority::kEvtPriMid));
+    EXPECT_FALSE(hub.Send(std::move(up)));
+    EXPECT_NE(up, nullptr);
+    EXPECT_TRUE(hub.Send(MakeEvent(20)));
+    EXPECT_TRUE(hub.Send(MakeEvent(20))); // dropped
+    /*! the latest event replaces the queued one */
+    EXPECT_TRUE(hub.Send(SpEvent(new SizedEvent(30, 1))));
+    EXPECT_TRUE(hub.Send(UpEvent(new SizedEvent(30, 2))));
+    EXPECT_TRUE(hub.Send(SpEvent(new SizedEvent(30, 4))));
+    /*! a replacement is held to the byte budget too */
+    EXPECT_FALSE(hub.Send(SpEvent(new SizedEvent(30, 5))));
+    EXPECT_TRUE(hub.SetLimit(10, 19, 0, 0, LimitAction::kDrop));
+    EXPECT_TRUE(hub.Send(MakeEvent(12)));
+
+    HubStats stats = hub.GetStats();
+    EXPECT_EQ(stats.limited, 6u);
+    EXPECT_EQ(stats.depth, 5u);
+    EXPECT_EQ(stats.bytes, 4u);
+    EXPECT_EQ(stats.peak_bytes, 4u);
+    DrainResult r = hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(r.dispatched, 5u);
+    EXPECT_EQ(count.count_.load(), 5);
+}
+
+namespace {
+
+class NameHandler : public EventHandler
+{
+  public:
+    virtual void OnEvent(const SpEvent evt)
+    {
+        char name[16] = {};
+        cpu_set_t set;
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+        name_ = name;
+        cpus_ = CPU_COUNT(&set);
+    }
+    std::string name_;
+    int cpus_ = 0;
+};
+
+}
+
+TEST(EventHub, SetThread)
+{
+    cpu_set_t set;
+    ASSERT_EQ(sched_getaffinity(0, sizeof(set), &set), 0);
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &set)) cpu++;
+
+    NameHandler handler;
+    EventHub hub(&handler, 4);
+    thread_attr attr = { "hub-test", 1ULL << cpu, SCHED_OTHER, 0, 256 * 1024 };
+    EXPECT_TRUE(hub.SetThread(attr));
+    EXPECT_FALSE(hub.SetThread(attr)); // already running
+    usleep(10000);
+    EXPECT_TRUE(hub.Send(MakeEvent(1)));
+    hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(handler.name_, "hub-test");
+    EXPECT_EQ(handler.cpus_, 1);
+
+    /*! attributes that cannot be applied leave a default thread */
+    EventHub fallback(&handler, 4);
+    attr.stack = 1;
+    EXPECT_FALSE(fallback.SetThread(attr));
+    usleep(10000);
+    EXPECT_TRUE(fallback.Send(MakeEvent(2)));
+    DrainResult r = fallback.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    EXPECT_EQ(r.dispatched, 1u);
+}
+
+TEST(EventBuffer, Share)
+{
+    EventBuffer empty;
+    EXPECT_TRUE(empty.Empty());
+    EXPECT_EQ(empty.UseCount(), 0u);
+    EXPECT_TRUE(EventBuffer::Allocate(0).Empty());
+
+    EventBuffer buf = EventBuffer::Copy("0123456789", 10);
+    ASSERT_EQ(buf.Size(), 10u);
+    EXPECT_EQ(buf.Capacity(), 256u);
+    EventBuffer copy = buf;
+    EventBuffer slice = buf.Slice(2, 5);
+    EXPECT_EQ(buf.UseCount(), 3u);
+    EXPECT_EQ(copy.Data(), buf.Data());
+    EXPECT_EQ(slice.Data(), buf.Data() + 2);
+    EXPECT_EQ(std::string((const char*)slice.Data(), slice.Size()), "23456");
+    /*! slices are clamped to the buffer */
+    EXPECT_EQ(slice.Slice(3, 100).Size(), 2u);
+    EXPECT_TRUE(slice.Slice(5, 1).Empty());
+
+    const uint8_t *data = buf.Data();
+    buf = EventBuffer();
+    copy = std::move(slice);
+    EXPECT_EQ(copy.UseCount(), 1u);
+    copy = EventBuffer();
+    /*! a released block is reused by its size class */
+    EXPECT_EQ(EventBuffer::Allocate(100).Data(), data);
+}
+
+TEST(EventBuffer, Large)
+{
+    EventBuffer heap = EventBuffer::Allocate(EventBuffer::kMaxSlab + 1);
+    EXPECT_EQ(heap.Capacity(), EventBuffer::kMaxSlab + 1);
+    EventBuffer mapped = EventBuffer::Allocate(EventBuffer::kMmapThreshold * 2);
+    ASSERT_EQ(mapped.Size(), EventBuffer::kMmapThreshold * 2);
+    memset(mapped.MutableData(), 0x5a, mapped.Size());
+    EventBuffer tail = mapped.Slice(mapped.Size() - 4, 4);
+    mapped = EventBuffer();
+    EXPECT_EQ(tail.Data()[3], 0x5a);
+}
+
+namespace {
+
+class PayloadHandler : public EventHandler
+{
+  public:
+    virtual void OnEvent(const SpEvent evt) { OnEvent(*evt); }
+    virtual void OnEvent(const Event &evt)
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        seen_.push_back(evt.Payload().Data());
+    }
+    std::mutex mutex_;
+    std::vector<const uint8_t*> seen_;
+};
+
+}
+
+TEST(EventHub, Payload)
+{
+    PayloadHandler handlers[3];
+    EventBuffer buf = EventBuffer::Copy("frame", 5);
+    EventHub hub(8);
+    hub.SetByteBudget(8);
+    EXPECT_TRUE(hub.SetFanOut(2, true));
+    for (auto &h : handlers) {
+        hub.Subscribe(&h);
+    }
+    SpEvent evt = MakeEvent(1);
+    evt->Attach(buf);
+    EXPECT_EQ(evt->Footprint(), 5u);
+    EXPECT_TRUE(hub.Send(evt));
+    UpEvent big(new TestEvent(2, EvtPriority::kEvtPriMid));
+    big->Attach(EventBuffer::Allocate(9));
+    /*! the payload counts against the byte budget */
+    EXPECT_FALSE(hub.Send(std::move(big)));
+    hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+
+    /*! every handler saw the producer's bytes */
+    for (auto &h : handlers) {
+        EXPECT_EQ(h.seen_, std::vector<const uint8_t*>({ buf.Data() }));
+    }
+}
+
+namespace {
+
+class BridgeHandler : public EventHandler
+{
+  public:
+    virtual void OnEvent(const SpEvent evt) { OnEvent(*evt); }
+    virtual void OnEvent(const Event &evt)
+    {
+        uint32_t v = 0;
+        if (evt.Payload().Size() == sizeof(v)) {
+            memcpy(&v, evt.Payload().Data(), sizeof(v));
+        }
+        std::lock_guard<std::mutex> l(mutex_);
+        seen_.emplace_back(evt.ID(), v);
+    }
+    std::mutex mutex_;
+    std::vector<std::pair<uint32_t, uint32_t>> seen_;
+};
+
+/*! send ids [0, n) carrying their id as payload, then close */
+void BridgeSend(BridgeSender &tx, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i) {
+        SpEvent evt = MakeEvent(i);
+        evt->Attach(EventBuffer::Copy(&i, sizeof(i)));
+        tx.OnEvent(evt);
+    }
+    tx.Close();
+}
+
+bool BridgeWait(BridgeReceiver &rx, uint64_t frames)
+{
+    for (int i = 0; i < 5000 && rx.GetStats().frames < frames; ++i) {
+        usleep(1000);
+    }
+    return rx.GetStats().frames == frames;
+}
+
+}
+
+TEST(Bridge, Tcp)
+{
+    BridgeHandler handler;
+    EventHub dst(64);
+    dst.Subscribe(&handler);
+    BridgeReceiver rx(dst);
+    ASSERT_TRUE(rx.ListenTcp(0));
+    ASSERT_NE(rx.Port(), 0);
+
+    /*! a tiny queue makes the sender block and batch */
+    BridgeSender tx(4, 2);
+    tx.Forward(10, 19);
+    ASSERT_TRUE(tx.ConnectTcp("127.0.0.1", rx.Port()));
+    BridgeSend(tx, 30);
+    BridgeStats stats = tx.GetStats();
+    EXPECT_EQ(stats.frames, 10u);
+    EXPECT_EQ(stats.bytes, 10 * (kBridgeHeader + 4));
+    EXPECT_EQ(stats.dropped, 0u);
+    EXPECT_FALSE(tx.Post(1, EvtPriority::kEvtPriMid, EventBuffer()));
+
+    ASSERT_TRUE(BridgeWait(rx, 10));
+    dst.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    ASSERT_EQ(handler.seen_.size(), 10u);
+    for (uint32_t i = 0; i < 10; ++i) {
+        EXPECT_EQ(handler.seen_[i], std::make_pair(10 + i, 10 + i));
+    }
+    rx.Close();
+}
+
+TEST(Bridge, UnixProcess)
+{
+    std::string path = "/tmp/evthub_bridge_" + std::to_string(getpid()) + ".sock";
+    BridgeHandler handler;
+    EventHub dst(256);
+    dst.Subscribe(&handler);
+    BridgeReceiver rx(dst);
+    ASSERT_TRUE(rx.ListenUnix(path));
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        BridgeSender tx;
+        if (!tx.ConnectUnix(path)) {
+            _exit(1);
+        }
+        BridgeSend(tx, 200);
+        _exit(tx.GetStats().frames == 200 ? 0 : 2);
+    }
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+
+    ASSERT_TRUE(BridgeWait(rx, 200));
+    dst.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    ASSERT_EQ(handler.seen_.size(), 200u);
+    for (uint32_t i = 0; i < 200; ++i) {
+        EXPECT_EQ(handler.seen_[i], std::make_pair(i, i));
+    }
+    rx.Close();
+    EXPECT_NE(access(path.c_str(), F_OK), 0);
+}
+
+TEST(Bridge, MaxFrame)
+{
+    BridgeHandler handler;
+    EventHub dst(64);
+    dst.Subscribe(&handler);
+    BridgeReceiver rx(dst);
+    rx.SetMaxFrame(8);
+    ASSERT_TRUE(rx.ListenTcp(0));
+
+    /*! the oversized frame closes the connection, what follows is lost */
+    uint32_t v = 1;
+    uint8_t big[16] = {};
+    BridgeSender tx;
+    ASSERT_TRUE(tx.ConnectTcp("127.0.0.1", rx.Port()));
+    EXPECT_TRUE(tx.Post(1, EvtPriority::kEvtPriMid, EventBuffer::Copy(&v, sizeof(v))));
+    EXPECT_TRUE(tx.Post(2, EvtPriority::kEvtPriMid, EventBuffer::Copy(big, sizeof(big))));
+    EXPECT_TRUE(tx.Post(3, EvtPriority::kEvtPriMid, EventBuffer::Copy(&v, sizeof(v))));
+    tx.Close();
+    for (int i = 0; i < 5000 && rx.GetStats().oversized == 0; ++i) {
+        usleep(1000);
+    }
+    BridgeStats stats = rx.GetStats();
+    EXPECT_EQ(stats.oversized, 1u);
+    EXPECT_EQ(stats.frames, 1u);
+
+    dst.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    ASSERT_EQ(handler.seen_.size(), 1u);
+    EXPECT_EQ(handler.seen_[0], std::make_pair(1u, 1u));
+    rx.Close();
+}
+
+TEST(Bridge, Evthub)
+{
+    evthub_t h = NULL;
+    std::vector<std::pair<uint32_t, uint32_t>> seen;
+    evthub_parm param = {
+        .max = 64,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = &seen,
+        .notifier = [](const event_t *evt, void *data) {
+            uint32_t v = 0;
+            if (evt->size == sizeof(v)) {
+                memcpy(&v, evt->param, sizeof(v));
+            }
+            static_cast<std::vector<std::pair<uint32_t, uint32_t>>*>(data)->emplace_back(evt->id, v);
+        },
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 0,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = sizeof(uint32_t)
+    };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    BridgeReceiver rx(h);
+    ASSERT_TRUE(rx.ListenTcp(0));
+
+    /*! an id evthub cannot carry is dropped */
+    BridgeSender tx;
+    ASSERT_TRUE(tx.ConnectTcp("127.0.0.1", rx.Port()));
+    uint32_t v = 300;
+    EXPECT_TRUE(tx.Post(v, EvtPriority::kEvtPriMid, EventBuffer::Copy(&v, sizeof(v))));
+    BridgeSend(tx, 20);
+
+    ASSERT_TRUE(BridgeWait(rx, 21));
+    EXPECT_EQ(rx.GetStats().dropped, 1u);
+    rx.Close();
+    EXPECT_EQ(evthub_drain(h, -1, NULL, NULL), UTILS_SUCC);
+    ASSERT_EQ(seen.size(), 20u);
+    for (uint32_t i = 0; i < 20; ++i) {
+        EXPECT_EQ(seen[i], std::make_pair(i, i));
+    }
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+TEST(Bridge, Priority)
+{
+    EXPECT_EQ(ToEvthubPriority(EvtPriority::kEvtPriHigh), 255);
+    EXPECT_EQ(FromEvthubPriority(255), EvtPriority::kEvtPriHigh);
+    EXPECT_EQ(FromEvthubPriority(128), EvtPriority::kEvtPriMid);
+    EXPECT_EQ(FromEvthubPriority(0), EvtPriority::kEvtPriLow);
+
+    /*! evthub into EventHub, the most urgent evthub event is dispatched first */
+    BridgeHandler handler;
+    EventHub dst(64);
+    /*! let the thread start and go idle, sends do not wake it in tests */
+    EXPECT_TRUE(dst.Send(MakeEvent(100)));
+    usleep(10000);
+    dst.Subscribe(&handler);
+    BridgeReceiver rx(dst);
+    ASSERT_TRUE(rx.ListenTcp(0));
+    BridgeSender tx;
+    ASSERT_TRUE(tx.ConnectTcp("127.0.0.1", rx.Port()));
+    event_t low = { 1, 0, NULL, 0 }, mid = { 2, 128, NULL, 0 }, high = { 3, 255, NULL, 0 };
+    BridgeSender::OnCEvent(&low, &tx);
+    BridgeSender::OnCEvent(&mid, &tx);
+    BridgeSender::OnCEvent(&high, &tx);
+    tx.Close();
+    ASSERT_TRUE(BridgeWait(rx, 3));
+    dst.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+    ASSERT_EQ(handler.seen_.size(), 3u);
+    EXPECT_EQ(handler.seen_[0].first, 3u);
+    EXPECT_EQ(handler.seen_[1].first, 2u);
+    EXPECT_EQ(handler.seen_[2].first, 1u);
+    rx.Close();
+
+    /*! EventHub priorities into a priority evthub keep their order */
+    evthub_t h = NULL;
+    std::vector<std::pair<uint32_t, uint32_t>> seen;
+    evthub_parm param = {
+        .max = 8,
+        .mode = EVENT_HUB_MODE_PRIORITY,
+        .user_data = &seen,
+        .notifier = [](const event_t *evt, void *data) {
+            static_cast<std::vector<std::pair<uint32_t, uint32_t>>*>(data)->emplace_back(
+                evt->id, evt->priority);
+        },
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 0,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = 0
+    };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    BridgeReceiver crx(h);
+    ASSERT_TRUE(crx.ListenTcp(0));
+    BridgeSender ctx;
+    ASSERT_TRUE(ctx.ConnectTcp("127.0.0.1", crx.Port()));
+    EXPECT_TRUE(ctx.Post(1, EvtPriority::kEvtPriLow, EventBuffer()));
+    EXPECT_TRUE(ctx.Post(2, EvtPriority::kEvtPriMid, EventBuffer()));
+    EXPECT_TRUE(ctx.Post(3, EvtPriority::kEvtPriHigh, EventBuffer()));
+    ctx.Close();
+    ASSERT_TRUE(BridgeWait(crx, 3));
+    crx.Close();
+    EXPECT_EQ(evthub_drain(h, -1, NULL, NULL), UTILS_SUCC);
+    EXPECT_EQ(seen, (std::vector<std::pair<uint32_t, uint32_t>>({ { 3, 255 }, { 2, 128 }, { 1, 0 } })));
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+namespace {
+
+class FieldEvent : public TestEvent
+{
+  public:
+    FieldEvent(uint32_t id, int64_t session) : TestEvent(id, EvtPriority::kEvtPriMid), session_(session) {}
+    virtual bool GetField(const char *name, int64_t &value) const
+    {
+        if (strcmp(name, "session") != 0) {
+            return false;
+        }
+        value = session_;
+        return true;
+    }
+
+  private:
+    int64_t session_;
+};
+
+}
+
+TEST(EventHub, SubscribeFilter)
+{
+    CountHandler all, ranged, session, high[2];
+    std::atomic<int> evaluated(0);
+    SpFilter shared = EventFilter::Predicate([&evaluated](const Event &evt) {
+        evaluated++;
+        return evt.ID() >= 15;
+    });
+    EventHub hub(64);
+    EXPECT_TRUE(hub.Subscribe(&all));
+    EXPECT_TRUE(hub.Subscribe(&ranged, 10, 19));
+    EXPECT_TRUE(hub.Subscribe(&session, 0, UINT32_MAX,
+                              EventFilter::Match({ { "session", FieldOp::kEq, 7 } })));
+    EXPECT_TRUE(hub.Subscribe(&high[0], 10, 19, shared));
+    EXPECT_TRUE(hub.Subscribe(&high[1], 10, 19, shared));
+    EXPECT_FALSE(hub.Subscribe(&all, 2, 1));
+
+    for (uint32_t i = 0; i < 20; ++i) {
+        EXPECT_TRUE(hub.Send(SpEvent(new FieldEvent(i, i % 2 ? 7 : 8))));
+    }
+    /*! no session field, the expression rejects it */
+    EXPECT_TRUE(hub.Send(MakeEvent(3)));
+    hub.Drain(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+
+    EXPECT_EQ(all.count_, 21);
+    EXPECT_EQ(ranged.count_, 10);
+    EXPECT_EQ(session.count_, 10);
+    EXPECT_EQ(high[0].count_, 5);
+    EXPECT_EQ(high[1].count_, 5);
+    /*! the shared predicate ran once per event of its range */
+    EXPECT_EQ(evaluated, 10);
+    /*! 11 for session, 5 for each high handler */
+    EXPECT_EQ(hub.GetStats().filtered, 21u);
+}
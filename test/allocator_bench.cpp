@@ -0,0 +1,89 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "allocator.h"
+
+struct bench_item {
+    char data[32];
+};
+
+ALLOCATOR_DECLARE(bitmap, struct bench_item);
+ALLOCATOR_IMPLEMENT(bitmap, struct bench_item);
+LF_ALLOCATOR_DECLARE(lockfree, struct bench_item);
+LF_ALLOCATOR_IMPLEMENT(lockfree, struct bench_item);
+
+static const int kPoolSize = 255;
+static const int kHold = 8;
+
+/*! Each thread keeps a few elements alive so the pool is not trivially empty */
+template<typename Alloc, typename Free>
+static double run(int threads, int loops, Alloc alloc, Free release)
+{
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            struct bench_item *held[kHold] = {};
+            for (int i = 0; i < loops; ++i) {
+                int slot = i % kHold;
+                if (held[slot]) release(held[slot]);
+                held[slot] = alloc();
+            }
+            for (int i = 0; i < kHold; ++i) {
+                if (held[i]) release(held[i]);
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return (double)ns / ((double)threads * loops);
+}
+
+int main(int argc, char **argv)
+{
+    int loops = argc > 1 ? atoi(argv[1]) : 1000000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    ALLOCATOR_DEFINE(bitmap, bp);
+    LF_ALLOCATOR_DEFINE(lockfree, lp);
+
+    ALLOCATOR_CREATE(bitmap, &bp, kPoolSize);
+    LF_ALLOCATOR_CREATE(lockfree, &lp, kPoolSize, 0);
+
+    printf("%-8s %16s %16s\n", "threads", "bitmap(ns/op)", "lockfree(ns/op)");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double b = run(threads, loops,
+            [&]() { return ALLOCATOR_ALLOC(bitmap, &bp); },
+            [&](struct bench_item *e) { ALLOCATOR_FREE(bitmap, &bp, e); });
+        double l = run(threads, loops,
+            [&]() { return LF_ALLOCATOR_ALLOC(lockfree, &lp); },
+            [&](struct bench_item *e) { LF_ALLOCATOR_FREE(lockfree, &lp, e); });
+        printf("%-8d %16.1f %16.1f\n", threads, b, l);
+    }
+
+    ALLOCATOR_DESTORY(bitmap, &bp);
+    LF_ALLOCATOR_DESTORY(lockfree, &lp);
+    return 0;
+}
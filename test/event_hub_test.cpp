@@ -1,9 +1,56 @@
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 #include <gtest/gtest.h>
 #include <event_hub.c>
 
+struct stress_item {
+    std::atomic<int> owner;
+};
+LF_ALLOCATOR_DECLARE(stress, struct stress_item);
+LF_ALLOCATOR_IMPLEMENT(stress, struct stress_item);
+
 evthub_t handle = NULL;
 
+/*! wake the dispatch threads, sending does not signal them in test mode */
+static void evthub_kick(evthub_t h)
+{
+    struct evthub_handle_t *evthub = (struct evthub_handle_t*)h;
+    if (evthub->ring) {
+        ring_wake(evthub->ring);
+        return;
+    }
+    for (unsigned int i = 0; i < evthub->nqueues; ++i) {
+        pthread_mutex_lock(&evthub->queues[i].mutex);
+        pthread_cond_broadcast(&evthub->queues[i].cond);
+        pthread_mutex_unlock(&evthub->queues[i].mutex);
+    }
+}
+
+/*! Wait until every worker sleeps on an empty queue */
+static void evthub_wait_idle(evthub_t h)
+{
+    struct evthub_handle_t *evthub = (struct evthub_handle_t*)h;
+    for (int i = 0; i < 1000; ++i) {
+        unsigned int waiters = 0;
+        for (unsigned int j = 0; j < evthub->nqueues; ++j) {
+            pthread_mutex_lock(&evthub->queues[j].mutex);
+            waiters += evthub->queues[j].count ? 0 : evthub->queues[j].waiters;
+            pthread_mutex_unlock(&evthub->queues[j].mutex);
+        }
+        if (waiters == evthub->nworkers) {
+            return;
+        }
+        usleep(1000);
+    }
+}
+
 static void event_recv(const event_t *evt, void *data)
 {
     if (evt) {
@@ -48,15 +95,15 @@ TEST(evthub, evthub_create)
     const int max = evthub->pool.size;
     struct evtinfo_t *e5, *e[max] = {};
     for (int i=0; i<max; ++i) {
-        e[i] = ALLOCATOR_ALLOC(evthub, &evthub->pool);
-        EXPECT_EQ(e[i], &evthub->pool.array[i].element);
+        e[i] = LF_ALLOCATOR_ALLOC(evthub, &evthub->pool);
+        EXPECT_EQ(e[i], &evthub->pool.array[0][i].element);
     }
 
-    e5 = ALLOCATOR_ALLOC(evthub, &evthub->pool);
+    e5 = LF_ALLOCATOR_ALLOC(evthub, &evthub->pool);
     EXPECT_EQ(e5, (struct evtinfo_t *)NULL);
 
     for (int i=0; i<max; ++i) {
-        s = ALLOCATOR_FREE(evthub, &evthub->pool, e[i]);
+        s = LF_ALLOCATOR_FREE(evthub, &evthub->pool, e[i]);
         EXPECT_EQ(s, UTILS_SUCC);
     }
 }
@@ -64,13 +111,11 @@ TEST(evthub, evthub_create)
 TEST(evthub, evthub_send_fifo)
 {
     int s;
-    struct evthub_handle_t *evthub;
     event_t evt = {
         .id = 1,
         .priority = 1,
         .param = NULL
     };
-    evthub = (struct evthub_handle_t*)handle;
 
     s = evthub_send(handle, &evt);
     EXPECT_EQ(s, UTILS_SUCC);
@@ -91,9 +136,7 @@ TEST(evthub, evthub_send_fifo)
     s = evthub_send(handle, &evt);
     EXPECT_EQ(s, UTILS_ERR_POOL_ALLOC);
 
-    pthread_mutex_lock(&evthub->ctrl.mutex);
-    pthread_cond_broadcast(&evthub->ctrl.cond);
-    pthread_mutex_unlock(&evthub->ctrl.mutex);
+    evthub_kick(handle);
     usleep(1000);
 }
 
@@ -128,12 +171,716 @@ TEST(evthub, evthub_send_priority)
     s = evthub_send(handle, &evt);
     EXPECT_EQ(s, UTILS_ERR_POOL_ALLOC);
 
-    pthread_mutex_lock(&evthub->ctrl.mutex);
-    pthread_cond_broadcast(&evthub->ctrl.cond);
-    pthread_mutex_unlock(&evthub->ctrl.mutex);
+    evthub_kick(handle);
     usleep(1000);
 }
 
+TEST(allocator, lf_allocator_stress)
+{
+    const int threads = 8, loops = 100000, size = 16;
+    std::atomic<int> errors(0);
+    std::vector<std::thread> workers;
+    LF_ALLOCATOR_DEFINE(stress, pool);
+
+    /*! a growable pool, with a thread releasing free slabs concurrently */
+    ASSERT_EQ(LF_ALLOCATOR_CREATE(stress, &pool, size / 4, size), UTILS_SUCC);
+    std::atomic<bool> done(false);
+    std::thread shrinker([&]() {
+        while (!done) {
+            if (LF_ALLOCATOR_SHRINK(stress, &pool) != UTILS_SUCC) errors++;
+            usleep(50);
+        }
+    });
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            for (int i = 0; i < loops; ++i) {
+                struct stress_item *e = LF_ALLOCATOR_ALLOC(stress, &pool);
+                if (e == NULL) continue;
+                /*! an element must never be handed out twice */
+                int expect = 0;
+                if (!e->owner.compare_exchange_strong(expect, t + 1)) errors++;
+                std::this_thread::yield();
+                expect = t + 1;
+                if (!e->owner.compare_exchange_strong(expect, 0)) errors++;
+                if (LF_ALLOCATOR_FREE(stress, &pool, e) != UTILS_SUCC) errors++;
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+    done = true;
+    shrinker.join();
+    EXPECT_EQ(errors.load(), 0);
+
+    /*! every element is back on the free list */
+    struct stress_item *e[size];
+    for (int i = 0; i < size; ++i) {
+        e[i] = LF_ALLOCATOR_ALLOC(stress, &pool);
+        EXPECT_NE(e[i], (struct stress_item *)NULL);
+    }
+    EXPECT_EQ(LF_ALLOCATOR_ALLOC(stress, &pool), (struct stress_item *)NULL);
+    LF_ALLOCATOR_DESTORY(stress, &pool);
+}
+
+TEST(allocator, lf_allocator_grow_shrink)
+{
+    const int slab = 100, ceiling = 1000;
+    struct stress_item *e[ceiling];
+    LF_ALLOCATOR_DEFINE(stress, pool);
+
+    ASSERT_EQ(LF_ALLOCATOR_CREATE(stress, &pool, slab, ceiling), UTILS_SUCC);
+    EXPECT_EQ(pool.size, (unsigned int)slab);
+    for (int i = 0; i < ceiling; ++i) {
+        e[i] = LF_ALLOCATOR_ALLOC(stress, &pool);
+        ASSERT_NE(e[i], (struct stress_item *)NULL);
+    }
+    EXPECT_EQ(pool.size, (unsigned int)ceiling);
+    EXPECT_EQ(LF_ALLOCATOR_ALLOC(stress, &pool), (struct stress_item *)NULL);
+
+    /*! a slab with a live element is kept, together with all below it */
+    for (int i = 0; i < ceiling; ++i) {
+        if (i != 3 * slab + 7) {
+            EXPECT_EQ(LF_ALLOCATOR_FREE(stress, &pool, e[i]), UTILS_SUCC);
+        }
+    }
+    EXPECT_EQ(LF_ALLOCATOR_SHRINK(stress, &pool), UTILS_SUCC);
+    EXPECT_EQ(pool.slabs, 4u);
+
+    EXPECT_EQ(LF_ALLOCATOR_FREE(stress, &pool, e[3 * slab + 7]), UTILS_SUCC);
+    EXPECT_EQ(LF_ALLOCATOR_SHRINK(stress, &pool), UTILS_SUCC);
+    EXPECT_EQ(pool.slabs, 1u);
+    EXPECT_EQ(pool.size, (unsigned int)slab);
+    for (int i = 0; i < slab; ++i) {
+        EXPECT_NE(LF_ALLOCATOR_ALLOC(stress, &pool), (struct stress_item *)NULL);
+    }
+    LF_ALLOCATOR_DESTORY(stress, &pool);
+}
+
+TEST(bitops, hbitmap_ffz_ffs)
+{
+    const int sizes[] = { 1, 63, 64, 65, 4096, 4097, 1 << 20 };
+    for (int n : sizes) {
+        struct hbitmap hb;
+        std::vector<unsigned long long> mem(hbitmap_words(n));
+        hbitmap_init(&hb, mem.data(), n);
+        EXPECT_EQ(hbitmap_ffz(&hb), 0);
+        EXPECT_EQ(hbitmap_ffs(&hb), -1);
+
+        for (int i = 0; i < n; ++i) {
+            hbitmap_set(&hb, i);
+        }
+        EXPECT_EQ(hbitmap_ffz(&hb), -1);
+        EXPECT_EQ(hbitmap_ffs(&hb), 0);
+
+        /*! clear from the top, the lowest cleared bit is the first zero */
+        for (int i = n - 1; i >= 0; i -= n / 7 + 1) {
+            hbitmap_clear(&hb, i);
+            EXPECT_EQ(hbitmap_ffz(&hb), i);
+            EXPECT_FALSE(hbitmap_test(&hb, i));
+        }
+        for (int i = 0; i < n; ++i) {
+            hbitmap_clear(&hb, i);
+        }
+        EXPECT_EQ(hbitmap_ffs(&hb), -1);
+        hbitmap_set(&hb, n - 1);
+        EXPECT_EQ(hbitmap_ffs(&hb), n - 1);
+        EXPECT_EQ(hbitmap_ffz(&hb), n > 1 ? 0 : -1);
+    }
+}
+
+static std::vector<std::vector<int>> batches;
+
+static void batch_recv(const event_t *evts, size_t n, void *data)
+{
+    std::vector<int> ids;
+    for (size_t i = 0; i < n; ++i) {
+        ids.push_back(evts[i].id);
+    }
+    batches.push_back(ids);
+}
+
+TEST(evthub, evthub_batch_notifier)
+{
+    evthub_t h = NULL;
+    evthub_parm param = {
+        .max = 4,
+        .mode = EVENT_HUB_MODE_PRIORITY,
+        .user_data = NULL,
+        .notifier = NULL,
+        .ceiling = 8,
+        .batch_notifier = batch_recv
+    };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+
+    batches.clear();
+    for (int i = 0; i < 8; ++i) {
+        event_t evt = { .id = (unsigned char)i, .priority = (unsigned char)(i % 2), .param = NULL };
+        EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    }
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && batches.size() < 2; ++i) {
+        usleep(1000);
+    }
+
+    /*! one take of all pending events, delivered in chunks of max */
+    std::vector<std::vector<int>> expect = { { 1, 3, 5, 7 }, { 0, 2, 4, 6 } };
+    EXPECT_EQ(batches, expect);
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+static void sub_recv(const event_t *evt, void *data)
+{
+    static_cast<std::vector<int>*>(data)->push_back(evt->id);
+}
+
+TEST(evthub, evthub_subscribe)
+{
+    evthub_t h = NULL;
+    std::vector<int> user, sys, any;
+    evthub_parm param = {
+        .max = 8,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = NULL,
+        .notifier = NULL
+    };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    ASSERT_EQ(evthub_subscribe(h, EVENT_ID_USER_BASE, EVENT_ID_SYS_BASE - 1, sub_recv, &user), UTILS_SUCC);
+    ASSERT_EQ(evthub_subscribe(h, EVENT_ID_SYS_BASE, EVENT_ID_END, sub_recv, &sys), UTILS_SUCC);
+    ASSERT_EQ(evthub_subscribe(h, 0x10, 0x10, sub_recv, &any), UTILS_SUCC);
+    EXPECT_EQ(evthub_subscribe(h, 0x20, 0x10, sub_recv, &any), UTILS_ERR_PARAM);
+
+    const unsigned char ids[] = { 0x01, 0x10, EVENT_ID_SYS_BASE, EVENT_ID_END };
+    for (unsigned char id : ids) {
+        event_t evt = { .id = id, .priority = 0, .param = NULL };
+        EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    }
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && sys.size() < 2; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(user, std::vector<int>({ 0x01, 0x10 }));
+    EXPECT_EQ(sys, std::vector<int>({ EVENT_ID_SYS_BASE, EVENT_ID_END }));
+    EXPECT_EQ(any, std::vector<int>({ 0x10 }));
+
+    /*! only the remaining subscribers are notified */
+    EXPECT_EQ(evthub_unsubscribe(h, EVENT_ID_USER_BASE, EVENT_ID_SYS_BASE - 1, sub_recv, &user), UTILS_SUCC);
+    EXPECT_EQ(evthub_unsubscribe(h, 0x10, 0x10, sub_recv, &user), UTILS_ERR_PARAM);
+    event_t evt = { .id = 0x10, .priority = 0, .param = NULL };
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && any.size() < 2; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(user.size(), 2u);
+    EXPECT_EQ(any, std::vector<int>({ 0x10, 0x10 }));
+
+    /*! a parked worker holds no list, retired ones are freed right away */
+    evthub_wait_idle(h);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(evthub_subscribe(h, 0x20, 0x20, sub_recv, &any), UTILS_SUCC);
+        EXPECT_EQ(evthub_unsubscribe(h, 0x20, 0x20, sub_recv, &any), UTILS_SUCC);
+    }
+    EXPECT_EQ(((struct evthub_handle_t*)h)->retired, nullptr);
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+struct worker_log {
+    std::mutex mutex;
+    std::map<int, std::vector<int>> seqs;       /*!< id -> sequence numbers */
+    std::map<int, std::set<std::thread::id>> threads;
+    size_t total = 0;
+};
+
+static void worker_recv(const event_t *evt, void *data)
+{
+    struct worker_log *log = static_cast<struct worker_log*>(data);
+    std::lock_guard<std::mutex> l(log->mutex);
+    log->seqs[evt->id].push_back((int)(intptr_t)evt->param);
+    log->threads[evt->id].insert(std::this_thread::get_id());
+    log->total++;
+}
+
+static void worker_run(evthub_order order, struct worker_log &log)
+{
+    const int ids = 16, rounds = 64;
+    evthub_t h = NULL;
+    evthub_parm param = {
+        .max = 64,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = &log,
+        .notifier = worker_recv,
+        .ceiling = ids * rounds,
+        .batch_notifier = NULL,
+        .workers = 4,
+        .order = order
+    };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    for (int r = 0; r < rounds; ++r) {
+        for (int id = 0; id < ids; ++id) {
+            event_t evt = { .id = (unsigned char)id, .priority = 0, .param = (void*)(intptr_t)r };
+            ASSERT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+        }
+    }
+    evthub_kick(h);
+    for (int i = 0; i < 5000; ++i) {
+        {
+            std::lock_guard<std::mutex> l(log.mutex);
+            if (log.total == (size_t)(ids * rounds)) break;
+        }
+        usleep(1000);
+    }
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+    EXPECT_EQ(log.total, (size_t)(ids * rounds));
+    EXPECT_EQ(log.seqs.size(), (size_t)ids);
+}
+
+TEST(evthub, evthub_workers_ordered)
+{
+    struct worker_log log;
+    worker_run(EVENT_HUB_ORDER_ID, log);
+    for (auto &it : log.seqs) {
+        /*! every id is handled by one worker, in send order */
+        std::vector<int> expect(it.second.size());
+        for (size_t i = 0; i < expect.size(); ++i) expect[i] = (int)i;
+        EXPECT_EQ(it.second, expect);
+        EXPECT_EQ(log.threads[it.first].size(), 1u);
+    }
+}
+
+TEST(evthub, evthub_workers_unordered)
+{
+    struct worker_log log;
+    worker_run(EVENT_HUB_ORDER_NONE, log);
+    for (auto &it : log.seqs) {
+        std::vector<int> seq = it.second;
+        std::sort(seq.begin(), seq.end());
+        EXPECT_EQ(seq.size(), 64u);
+        EXPECT_EQ(std::unique(seq.begin(), seq.end()), seq.end());
+    }
+}
+
+static void data_recv(const event_t *evt, void *data)
+{
+    static_cast<std::vector<std::string>*>(data)->push_back(
+        std::string((const char*)evt->param, evt->size));
+}
+
+TEST(evthub, evthub_send_data)
+{
+    evthub_t h = NULL;
+    std::vector<std::string> recv;
+    char big[65] = {};
+    evthub_parm param = {
+        .max = 4,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = &recv,
+        .notifier = data_recv,
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 0,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = 64
+    };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 1, 0, "first", 5), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 2, 0, "second", 6), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 3, 0, NULL, 0), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 4, 0, big, sizeof(big)), UTILS_ERR_PARAM);
+    /*! a size left over by the caller is not taken as inline data */
+    event_t evt = { 5, 0, big, 1234 };
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && recv.size() < 4; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(recv, std::vector<std::string>({ "first", "second", "", "" }));
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+TEST(evthub, evthub_spsc)
+{
+    evthub_t h = NULL;
+    std::vector<std::string> recv;
+    evthub_parm param = {
+        .max = 3,
+        .mode = EVENT_HUB_MODE_SPSC,
+        .user_data = &recv,
+        .notifier = data_recv,
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 4,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = 16
+    };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    struct evthub_handle_t *evthub = (struct evthub_handle_t*)h;
+    ASSERT_NE(evthub->ring, nullptr);
+    EXPECT_EQ(evthub->nworkers, 1u);
+    EXPECT_EQ(evthub->ring->mask, 3u);
+    for (int i = 0; i < 1000 && !__atomic_load_n(&evthub->ring->parked, __ATOMIC_SEQ_CST); ++i) {
+        usleep(1000);
+    }
+
+    /*! worker is parked, so the ring fills up until it is woken */
+    EXPECT_EQ(evthub_send_data(h, 1, 0, "a", 1), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 2, 9, "bb", 2), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 3, 0, "ccc", 3), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 4, 0, "dddd", 4), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 5, 0, "e", 1), UTILS_ERR_POOL_FULL);
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && recv.size() < 4; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(recv, std::vector<std::string>({ "a", "bb", "ccc", "dddd" }));
+
+    /*! slots are reused once the worker moves past them */
+    EXPECT_EQ(evthub_send_data(h, 5, 0, "e", 1), UTILS_SUCC);
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && recv.size() < 5; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(recv.back(), "e");
+
+    /*! evthub_send events carry no inline data whatever their size says */
+    event_t evt = { 6, 0, (void*)"garbage", 1234 };
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && recv.size() < 6; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(recv.back(), "");
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+TEST(evthub, evthub_send_timed)
+{
+    evthub_t h = NULL;
+    std::atomic<int> recv(0);
+    evthub_parm param = {
+        .max = 2,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = &recv,
+        .notifier = [](const event_t*, void *data) {
+            static_cast<std::atomic<int>*>(data)->fetch_add(1);
+        },
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 0,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = 0
+    };
+    event_t evt = {};
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    evthub_wait_idle(h);
+    EXPECT_EQ(evthub_send_timed(h, &evt, 0), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_timed(h, &evt, 0), UTILS_SUCC);
+
+    /*! workers are not woken by sends in tests, so the pool stays full */
+    EXPECT_EQ(evthub_send_timed(h, &evt, 0), UTILS_ERR_POOL_ALLOC);
+    EXPECT_EQ(evthub_send_timed(h, &evt, 5000000), UTILS_ERR_TIMEOUT);
+
+    /*! a blocked sender goes on once the worker releases the pool */
+    std::atomic<int> sent(1);
+    std::thread sender([&]() { sent = evthub_send_timed(h, &evt, -1); });
+    usleep(5000);
+    EXPECT_EQ(sent.load(), 1);
+    evthub_kick(h);
+    sender.join();
+    EXPECT_EQ(sent.load(), UTILS_SUCC);
+
+    /*! destroying the hub wakes blocked senders */
+    evthub_wait_idle(h);
+    while (evthub_send_timed(h, &evt, 0) == UTILS_SUCC) {
+    }
+    sent = 1;
+    std::thread closed([&]() { sent = evthub_send_timed(h, &evt, -1); });
+    while (!__atomic_load_n(&((struct evthub_handle_t*)h)->space_waiters, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+    closed.join();
+    EXPECT_EQ(sent.load(), UTILS_ERR_HUB_CLOSED);
+}
+
+TEST(evthub, evthub_send_data_timed)
+{
+    evthub_t h = NULL;
+    std::atomic<int> recv(0);
+    evthub_parm param = {
+        .max = 1,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = &recv,
+        .notifier = [](const event_t *evt, void *data) {
+            int v = 0;
+            memcpy(&v, evt->param, sizeof(v));
+            static_cast<std::atomic<int>*>(data)->fetch_add(v);
+        },
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 0,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = sizeof(int)
+    };
+    int one = 1, two = 2;
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    evthub_wait_idle(h);
+    EXPECT_EQ(evthub_send_data_timed(h, 1, 0, &one, sizeof(one), 0), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data_timed(h, 1, 0, &two, sizeof(two), 5000000), UTILS_ERR_TIMEOUT);
+
+    /*! the waiter copies its data once the worker releases the pool */
+    std::atomic<int> sent(1);
+    std::thread sender([&]() { sent = evthub_send_data_timed(h, 1, 0, &two, sizeof(two), -1); });
+    usleep(5000);
+    EXPECT_EQ(sent.load(), 1);
+    evthub_kick(h);
+    sender.join();
+    EXPECT_EQ(sent.load(), UTILS_SUCC);
+    EXPECT_EQ(evthub_drain(h, -1, NULL, NULL), UTILS_SUCC);
+    EXPECT_EQ(recv.load(), 3);
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+TEST(evthub, evthub_shrink_idle)
+{
+    evthub_t h = NULL;
+    std::atomic<int> recv(0);
+    evthub_parm param = {
+        .max = 4,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = &recv,
+        .notifier = [](const event_t*, void *data) {
+            static_cast<std::atomic<int>*>(data)->fetch_add(1);
+        },
+        .ceiling = 16
+    };
+    event_t evt = {};
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    struct evthub_handle_t *evthub = (struct evthub_handle_t*)h;
+    evthub_wait_idle(h);
+    for (int i = 0; i < 12; ++i) {
+        EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    }
+    EXPECT_EQ(evthub->pool.slabs, 3u);
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && recv < 12; ++i) {
+        usleep(1000);
+    }
+    /*! going idle once does not shrink, staying idle does */
+    EXPECT_EQ(recv.load(), 12);
+    EXPECT_EQ(__atomic_load_n(&evthub->pool.slabs, __ATOMIC_RELAXED), 3u);
+    for (int i = 0; i < 1000 && __atomic_load_n(&evthub->pool.slabs, __ATOMIC_RELAXED) > 1; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(__atomic_load_n(&evthub->pool.slabs, __ATOMIC_RELAXED), 1u);
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+TEST(evthub, evthub_drain)
+{
+    evthub_t h = NULL;
+    std::atomic<int> recv(0);
+    unsigned long long dispatched = 0, dropped = 0;
+    evthub_parm param = {
+        .max = 2,
+        .mode = EVENT_HUB_MODE_PRIORITY,
+        .user_data = &recv,
+        .notifier = [](const event_t*, void *data) {
+            static_cast<std::atomic<int>*>(data)->fetch_add(1);
+        },
+        .ceiling = 8,
+        .batch_notifier = NULL,
+        .workers = 2,
+        .order = EVENT_HUB_ORDER_ID,
+        .payload = 0
+    };
+    event_t evt = {};
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    evthub_wait_idle(h);
+    for (int i = 0; i < 6; ++i) {
+        evt.id = (unsigned char)i;
+        EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    }
+    EXPECT_EQ(evthub_drain(h, -1, &dispatched, &dropped), UTILS_SUCC);
+    EXPECT_EQ(dispatched, 6u);
+    EXPECT_EQ(dropped, 0u);
+    EXPECT_EQ(recv.load(), 6);
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_ERR_HUB_CLOSED);
+    EXPECT_EQ(evthub_send_timed(h, &evt, -1), UTILS_ERR_HUB_CLOSED);
+    EXPECT_EQ(evthub_drain(h, -1, NULL, NULL), UTILS_ERR_HUB_CLOSED);
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+
+    /*! slow handler, the deadline hits while events are pending */
+    param.notifier = [](const event_t*, void *data) {
+        usleep(20000);
+        static_cast<std::atomic<int>*>(data)->fetch_add(1);
+    };
+    param.workers = 1;
+    recv = 0;
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    evthub_wait_idle(h);
+    for (int i = 0; i < 6; ++i) {
+        EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    }
+    EXPECT_EQ(evthub_drain(h, 10000000, &dispatched, &dropped), UTILS_ERR_TIMEOUT);
+    EXPECT_GE(dispatched, 2u);
+    EXPECT_GT(dropped, 0u);
+    EXPECT_EQ(dispatched + dropped, 6u);
+    EXPECT_EQ((unsigned long long)recv.load(), dispatched);
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
+TEST(evthub, evthub_trace)
+{
+    evthub_t h = NULL;
+    evthub_parm param = {
+        .max = 8,
+        .mode = EVENT_HUB_MODE_PRIORITY,
+        .user_data = NULL,
+        .notifier = NULL,
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 0,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = 16
+    };
+    const char *path = "evthub_trace_test.bin";
+    event_t evt = { 7, 3, NULL, 0 };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC); // not traced yet
+    EXPECT_EQ(evthub_trace(h, path), UTILS_SUCC);
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 9, 200, "payload", 7), UTILS_SUCC);
+    EXPECT_EQ(evthub_trace(h, NULL), UTILS_SUCC);
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC); // stopped
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+
+    FILE *f = evttrace_load(path);
+    ASSERT_NE(f, nullptr);
+    evttrace_record r[3];
+    ASSERT_EQ(evttrace_read(f, &r[0]), 1);
+    ASSERT_EQ(evttrace_read(f, &r[1]), 1);
+    EXPECT_EQ(evttrace_read(f, &r[2]), 0);
+    fclose(f);
+    unlink(path);
+    EXPECT_EQ(r[0].id, 7u);
+    EXPECT_EQ(r[0].priority, 3u);
+    EXPECT_EQ(r[0].size, 0u);
+    EXPECT_EQ(r[1].id, 9u);
+    EXPECT_EQ(r[1].priority, 200u);
+    EXPECT_EQ(r[1].size, 7u);
+    EXPECT_LE(r[0].timestamp, r[1].timestamp);
+    EXPECT_EQ(r[0].producer, evttrace_tid());
+}
+
+TEST(evthub, evthub_limit)
+{
+    evthub_t h = NULL;
+    std::vector<std::string> recv;
+    evthub_parm param = {
+        .max = 16,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = &recv,
+        .notifier = data_recv,
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 0,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = 16
+    };
+    event_t evt = { 1, 0, (void*)"", 0 };
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    EXPECT_EQ(evthub_limit(h, 1, 1, 1, 0, EVENT_HUB_LIMIT_REJECT), UTILS_ERR_PARAM);
+    EXPECT_EQ(evthub_limit(h, 2, 1, 1, 1, EVENT_HUB_LIMIT_REJECT), UTILS_ERR_PARAM);
+    EXPECT_EQ(evthub_limit(h, 1, 1, 1, 2, EVENT_HUB_LIMIT_REJECT), UTILS_SUCC);
+    EXPECT_EQ(evthub_limit(h, 2, 2, 1, 1, EVENT_HUB_LIMIT_DROP), UTILS_SUCC);
+    EXPECT_EQ(evthub_limit(h, 3, 3, 1, 1, EVENT_HUB_LIMIT_CONFLATE), UTILS_SUCC);
+    evthub_wait_idle(h);
+
+    /*! a burst of 2, then one event per second */
+    EXPECT_EQ(evthub_send_data(h, 1, 0, "1a", 2), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 1, 0, "1b", 2), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 1, 0, "1c", 2), UTILS_ERR_RATE_LIMITED);
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_ERR_RATE_LIMITED);
+    EXPECT_EQ(evthub_send_data(h, 2, 0, "2a", 2), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 2, 0, "2b", 2), UTILS_SUCC); // dropped
+    /*! the latest event of a conflated id replaces the pending one, and
+     *  is traced like a queued one */
+    const char *path = "evthub_limit_test.bin";
+    EXPECT_EQ(evthub_trace(h, path), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 3, 0, "3a", 2), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 3, 0, "3b", 2), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 3, 0, "3c", 2), UTILS_SUCC);
+    EXPECT_EQ(evthub_trace(h, NULL), UTILS_SUCC);
+    EXPECT_EQ(evthub_limit(h, 1, 1, 0, 0, EVENT_HUB_LIMIT_DROP), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 1, 0, "1d", 2), UTILS_SUCC);
+    EXPECT_EQ(evthub_send_data(h, 5, 0, "5a", 2), UTILS_SUCC);
+
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && recv.size() < 6; ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(recv, std::vector<std::string>({ "1a", "1b", "2a", "3c", "1d", "5a" }));
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+
+    FILE *f = evttrace_load(path);
+    ASSERT_NE(f, nullptr);
+    evttrace_record r;
+    int n = 0;
+    while (evttrace_read(f, &r) == 1) {
+        EXPECT_EQ(r.id, 3u);
+        EXPECT_EQ(r.size, 2u);
+        n++;
+    }
+    fclose(f);
+    unlink(path);
+    EXPECT_EQ(n, 3);
+}
+
+static void name_recv(const event_t *evt, void *data)
+{
+    char name[16] = {};
+    cpu_set_t set;
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+    auto *names = static_cast<std::vector<std::string>*>(data);
+    names->push_back(std::string(name) + (CPU_COUNT(&set) == 1 ? "/1" : "/n"));
+}
+
+TEST(evthub, evthub_thread_attr)
+{
+    evthub_t h = NULL;
+    std::vector<std::string> names;
+    cpu_set_t set;
+    ASSERT_EQ(sched_getaffinity(0, sizeof(set), &set), 0);
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &set)) cpu++;
+    thread_attr attr = { "evthub-test-long", 1ULL << cpu, SCHED_OTHER, 0, 1 };
+    evthub_parm param = {
+        .max = 4,
+        .mode = EVENT_HUB_MODE_FIFO,
+        .user_data = &names,
+        .notifier = name_recv,
+        .ceiling = 0,
+        .batch_notifier = NULL,
+        .workers = 0,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = 0,
+        .thread = &attr
+    };
+    /*! a stack below PTHREAD_STACK_MIN is refused */
+    EXPECT_EQ(evthub_create(&h, &param), UTILS_ERR_PARAM);
+
+    attr.stack = 256 * 1024;
+    ASSERT_EQ(evthub_create(&h, &param), UTILS_SUCC);
+    event_t evt = { 1, 0, NULL, 0 };
+    EXPECT_EQ(evthub_send(h, &evt), UTILS_SUCC);
+    evthub_kick(h);
+    for (int i = 0; i < 1000 && names.empty(); ++i) {
+        usleep(1000);
+    }
+    EXPECT_EQ(names, std::vector<std::string>({ "evthub-test-lon/1" }));
+    EXPECT_EQ(evthub_destory(&h), UTILS_SUCC);
+}
+
 TEST(evthub, evthub_destory)
 {
     int s = evthub_destory(&handle);
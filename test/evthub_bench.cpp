@@ -0,0 +1,83 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*! Measure the hub itself, so the worker has to be woken by evthub_send */
+#undef TEST_ON
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <atomic>
+#include <chrono>
+#include "event_hub.c"
+
+static const unsigned int kQueueSize = 1024;
+
+static void on_events(const event_t *evts, size_t n, void *data)
+{
+    (void)evts;
+    static_cast<std::atomic<long>*>(data)->fetch_add((long)n, std::memory_order_release);
+}
+
+/*! One producer sends as fast as the hub accepts, returns ns per event */
+static double run(evthub_mode mode, long events)
+{
+    evthub_t h = NULL;
+    std::atomic<long> received(0);
+    evthub_parm param = {
+        .max = kQueueSize,
+        .mode = mode,
+        .user_data = &received,
+        .notifier = NULL,
+        .ceiling = 0,
+        .batch_notifier = on_events,
+        .workers = 1,
+        .order = EVENT_HUB_ORDER_NONE,
+        .payload = 0
+    };
+    if (evthub_create(&h, &param) != UTILS_SUCC) {
+        return -1.0;
+    }
+    event_t evt = {};
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < events; ++i) {
+        evt.id = (unsigned int)(i & 0xff);
+        while (evthub_send(h, &evt) != UTILS_SUCC) {
+            sched_yield();
+        }
+    }
+    while (received.load(std::memory_order_acquire) < events) {
+        sched_yield();
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    evthub_destory(&h);
+    return (double)ns / (double)events;
+}
+
+int main(int argc, char **argv)
+{
+    long events = argc > 1 ? atol(argv[1]) : 1000000;
+    printf("%-8s %16s\n", "mode", "ns/event");
+    printf("%-8s %16.1f\n", "fifo", run(EVENT_HUB_MODE_FIFO, events));
+    printf("%-8s %16.1f\n", "spsc", run(EVENT_HUB_MODE_SPSC, events));
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * A very simple utilities that exchange event asynchronously via another thread.
+ *
+ * Author wanch
+ * Date 2022/11/23
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*! Replays an evttrace file against evthub or EventHub and reports the
+ *  throughput and the send to dispatch latency.
+ *
+ *  usage: evthub_replay <trace> [c|cpp] [speed]
+ *    speed  1 keeps the recorded pace (default), N replays N times faster,
+ *           max sends as fast as the hub accepts
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <map>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "evttrace.h"
+#include "event_hub.h"
+#include "errors.h"
+#include "EventHub.h"
+
+using namespace utils;
+
+static const unsigned int kQueueSize = 4096;
+static const unsigned int kMaxPayload = 1024;
+
+/*! Latencies are appended by the single dispatch thread of either hub */
+struct Collector {
+    std::vector<uint64_t> latency;
+    std::atomic<size_t> received{0};
+
+    void Record(uint64_t sent)
+    {
+        latency.push_back(evttrace_now() - sent);
+        received.fetch_add(1, std::memory_order_release);
+    }
+};
+
+class ReplayEvent : public Event
+{
+  public:
+    ReplayEvent(const evttrace_record &r)
+      : id_(r.id), pri_(FromEvthubPriority(r.priority))
+      , payload_(std::min(r.size, kMaxPayload)), sent_(evttrace_now()) {}
+    virtual uint32_t ID() const { return id_; }
+    virtual const char* Name() const { return "replay"; }
+    virtual EvtPriority Priority() const { return pri_; }
+    uint64_t Sent() const { return sent_; }
+
+  private:
+    uint32_t id_;
+    EvtPriority pri_;
+    std::vector<char> payload_;
+    uint64_t sent_;
+};
+
+class ReplayHandler : public EventHandler
+{
+  public:
+    explicit ReplayHandler(Collector &c) : c_(c) {}
+    virtual void OnEvent(const SpEvent evt) { OnEvent(*evt); }
+    virtual void OnEvent(const Event &evt)
+    {
+        c_.Record(static_cast<const ReplayEvent&>(evt).Sent());
+    }
+
+  private:
+    Collector &c_;
+};
+
+static void on_replay(const event_t *evt, void *data)
+{
+    uint64_t sent;
+    memcpy(&sent, evt->param, sizeof(sent));
+    static_cast<Collector*>(data)->Record(sent);
+}
+
+/*! Send one producer's records at their recorded offsets divided by speed */
+template<typename SendFn>
+static void produce(const std::vector<evttrace_record> &recs, uint64_t first,
+                    uint64_t start, double speed, SendFn send)
+{
+    for (auto &r : recs) {
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)((r.timestamp - first) / speed);
+            uint64_t now = evttrace_now();
+            if (due > now) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+            }
+        }
+        while (!send(r)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+    return sorted[i] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <trace> [c|cpp] [speed|max]\n", argv[0]);
+        return 1;
+    }
+    bool cpp = argc > 2 && strcmp(argv[2], "cpp") == 0;
+    double speed = argc > 3 ? (strcmp(argv[3], "max") == 0 ? 0 : atof(argv[3])) : 1.0;
+    if (argc > 3 && strcmp(argv[3], "max") != 0 && speed <= 0) {
+        fprintf(stderr, "bad speed %s\n", argv[3]);
+        return 1;
+    }
+
+    FILE *f = evttrace_load(argv[1]);
+    if (f == nullptr) {
+        fprintf(stderr, "%s is not a trace\n", argv[1]);
+        return 1;
+    }
+    evttrace_record r;
+    std::vector<evttrace_record> recs;
+    while (evttrace_read(f, &r)) {
+        recs.push_back(r);
+    }
+    fclose(f);
+    if (recs.empty()) {
+        fprintf(stderr, "%s has no events\n", argv[1]);
+        return 1;
+    }
+    /*! evthub ids are one byte, replaying the rest would alias them */
+    size_t skipped = 0;
+    if (!cpp) {
+        auto wide = std::remove_if(recs.begin(), recs.end(),
+            [](const evttrace_record &rec) { return rec.id > UCHAR_MAX; });
+        skipped = recs.end() - wide;
+        recs.erase(wide, recs.end());
+        if (recs.empty()) {
+            fprintf(stderr, "%s has no event with an id up to %d\n", argv[1], UCHAR_MAX);
+            return 1;
+        }
+    }
+    std::stable_sort(recs.begin(), recs.end(),
+        [](const evttrace_record &a, const evttrace_record &b) { return a.timestamp < b.timestamp; });
+    std::map<uint32_t, std::vector<evttrace_record>> producers;
+    for (auto &rec : recs) {
+        producers[rec.producer].push_back(rec);
+    }
+
+    Collector c;
+    c.latency.reserve(recs.size());
+    std::unique_ptr<EventHub> hub;
+    std::unique_ptr<ReplayHandler> handler;
+    evthub_t h = nullptr;
+    if (cpp) {
+        handler.reset(new ReplayHandler(c));
+        hub.reset(new EventHub(handler.get(), kQueueSize));
+    } else {
+        evthub_parm param = {
+            .max = kQueueSize,
+            .mode = EVENT_HUB_MODE_PRIORITY,
+            .user_data = &c,
+            .notifier = on_replay,
+            .ceiling = 0,
+            .batch_notifier = nullptr,
+            .workers = 0,
+            .order = EVENT_HUB_ORDER_NONE,
+            .payload = kMaxPayload,
+            .thread = nullptr
+        };
+        if (evthub_create(&h, &param) != UTILS_SUCC) {
+            fprintf(stderr, "evthub_create failed\n");
+            return 1;
+        }
+    }
+
+    uint64_t first = recs.front().timestamp;
+    uint64_t start = evttrace_now();
+    std::vector<std::thread> threads;
+    for (auto &p : producers) {
+        const std::vector<evttrace_record> &mine = p.second;
+        threads.emplace_back([&, speed, first, start]() {
+            std::vector<char> data(kMaxPayload);
+            if (cpp) {
+                produce(mine, first, start, speed, [&](const evttrace_record &rec) {
+                    return hub->Send(UpEvent(new ReplayEvent(rec)));
+                });
+            } else {
+                produce(mine, first, start, speed, [&](const evttrace_record &rec) {
+                    uint64_t sent = evttrace_now();
+                    size_t len = std::max<size_t>(sizeof(sent), std::min(rec.size, kMaxPayload));
+                    memcpy(data.data(), &sent, sizeof(sent));
+                    return evthub_send_data(h, (event_id)rec.id, rec.priority,
+                                            data.data(), len) == UTILS_SUCC;
+                });
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    while (c.received.load(std::memory_order_acquire) < recs.size()) {
+        std::this_thread::yield();
+    }
+    double elapsed = (evttrace_now() - start) / 1e9;
+    if (h) {
+        evthub_destory(&h);
+    }
+    hub.reset();
+
+    std::sort(c.latency.begin(), c.latency.end());
+    printf("hub        %s\n", cpp ? "EventHub" : "evthub");
+    printf("events     %zu from %zu producers\n", recs.size(), producers.size());
+    if (skipped) {
+        printf("skipped    %zu with an id over %d\n", skipped, UCHAR_MAX);
+    }
+    printf("elapsed    %.3f s (trace %.3f s)\n", elapsed, (recs.back().timestamp - first) / 1e9);
+    printf("throughput %.0f events/s\n", recs.size() / elapsed);
+    printf("latency us p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+           percentile(c.latency, 50), percentile(c.latency, 90),
+           percentile(c.latency, 99), percentile(c.latency, 99.9),
+           c.latency.back() / 1000.0);
+    return 0;
+}